@@ -0,0 +1,327 @@
+#include "runtime.hpp"
+#include "profiling.hpp"
+#include "task.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// Microbenchmarks of the hot paths. Every case runs a fixed amount of work
+/// after a warmup, so numbers are comparable across commits:
+///
+///     bench [--json PATH] [--filter SUBSTRING] [--quick]
+///
+/// Percentiles are of per-batch ns/op for the micro cases and of request
+/// round trips for echo.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string name;
+    uint64_t ops = 0;
+    double seconds = 0;
+    /// Nanoseconds per sample
+    Histogram samples;
+};
+
+struct Options {
+    std::string json;
+    std::string filter;
+    /// Tenth of the work, for smoke runs
+    bool quick = false;
+};
+
+Options options;
+
+uint64_t scaled(uint64_t count) {
+    return options.quick ? std::max<uint64_t>(count / 10, 1) : count;
+}
+
+uint64_t ns_since(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+/// Run op(batch) for batches times, each sample is ns/op of one batch
+template <class Op>
+Result batched(std::string name, uint64_t batches, uint64_t batch, Op op) {
+    op(batch);
+    Result result;
+    result.name = std::move(name);
+    auto start = Clock::now();
+    for (uint64_t i = 0; i != batches; ++i) {
+        auto batch_start = Clock::now();
+        op(batch);
+        result.samples.record(ns_since(batch_start) / batch);
+    }
+    result.seconds = ns_since(start) / 1e9;
+    result.ops = batches * batch;
+    return result;
+}
+
+/// Bare context switch to a fiber and back, no scheduler involved. The fiber
+/// never finishes: its context is dropped while suspended, the callable left
+/// on the freed stack is trivially destructible.
+Result bench_switch() {
+    Context *self = nullptr;
+    /// Big enough to be bound to a stack at creation, so it can be switched to directly
+    struct Body {
+        Context **self;
+        char pad[Closure::INLINE_SIZE];
+
+        void operator()() {
+            while (true) {
+                (*self)->switch_context(Action{Action::SCHED});
+            }
+        }
+    };
+    auto context = FiberScheduler::create_context_from_fiber(Body{&self, {}});
+    self = context.get();
+    return batched("switch", scaled(2000), 1000, [&](uint64_t n) {
+        for (uint64_t i = 0; i != n; ++i) {
+            context->switch_context(Action{Action::START});
+        }
+    });
+}
+
+Result bench_spawn() {
+    return batched("spawn", scaled(200), 1000, [](uint64_t n) {
+        EpollScheduler sched;
+        for (uint64_t i = 0; i != n; ++i) {
+            sched.schedule([]() {});
+        }
+        scheduler_run(sched);
+    });
+}
+
+Async::Task<void> empty_task() {
+    co_return;
+}
+
+/// Same as spawn with a coroutine frame instead of a stack
+Result bench_task() {
+    return batched("task", scaled(200), 1000, [](uint64_t n) {
+        EpollScheduler sched;
+        for (uint64_t i = 0; i != n; ++i) {
+            Async::start(sched, empty_task());
+        }
+        scheduler_run(sched);
+    });
+}
+
+Result bench_yield(size_t fibers) {
+    auto rounds = std::max<uint64_t>(scaled(1000000) / fibers, 10);
+    return batched("yield/" + std::to_string(fibers), 5, rounds * fibers, [&](uint64_t n) {
+        EpollScheduler sched;
+        for (size_t i = 0; i != fibers; ++i) {
+            sched.schedule([=]() {
+                for (uint64_t j = 0; j != n / fibers; ++j) {
+                    yield();
+                }
+            });
+        }
+        scheduler_run(sched);
+    });
+}
+
+/// Fan-out of n fibers and fan-in of their results by when_all
+Result bench_when_all() {
+    return batched("when_all", scaled(200), 1000, [](uint64_t n) {
+        EpollScheduler sched;
+        sched.schedule([n]() {
+            std::vector<JoinHandle<uint64_t>> handles;
+            handles.reserve(n);
+            for (uint64_t i = 0; i != n; ++i) {
+                handles.push_back(spawn([i]() {
+                    yield();
+                    return i;
+                }));
+            }
+            when_all(handles);
+        });
+        scheduler_run(sched);
+    });
+}
+
+Result bench_stack_pool() {
+    StackPool pool;
+    std::vector<StackPool::Stack> live;
+    live.reserve(64);
+    return batched("stack_pool", scaled(2000), 64, [&](uint64_t n) {
+        for (uint64_t i = 0; i != n; ++i) {
+            live.push_back(pool.alloc());
+        }
+        live.clear();
+    });
+}
+
+/// Clients do requests round trips of a 64 byte message each, at once
+Result bench_echo(size_t connections, uint64_t requests) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        throw std::system_error(errno, std::generic_category(), "listen");
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (sockaddr*)&addr, &len);
+
+    Result result;
+    result.name = "echo/" + std::to_string(connections);
+    EpollScheduler sched;
+    size_t done = 0;
+
+    sched.schedule([&]() {
+        std::vector<int> clients;
+        while (Async::accept_all(listener, clients)) {
+            for (auto fd : clients) {
+                schedule([fd]() {
+                    char buf[64];
+                    ssize_t r;
+                    while ((r = Async::read(fd, buf, sizeof(buf))) > 0) {
+                        for (ssize_t off = 0; off < r;) {
+                            off += Async::write(fd, buf + off, r - off);
+                        }
+                    }
+                    Async::close(fd);
+                });
+            }
+            clients.clear();
+        }
+    });
+
+    Clock::time_point start;
+    for (size_t i = 0; i != connections; ++i) {
+        sched.schedule([&]() {
+            int fd = Async::connect((sockaddr*)&addr, sizeof(addr));
+            char buf[64] = {};
+            for (uint64_t j = 0; j != requests; ++j) {
+                auto sent = Clock::now();
+                for (size_t off = 0; off < sizeof(buf);) {
+                    off += Async::write(fd, buf + off, sizeof(buf) - off);
+                }
+                for (size_t off = 0; off < sizeof(buf);) {
+                    auto r = Async::read(fd, buf + off, sizeof(buf) - off);
+                    if (r == 0) {
+                        throw std::runtime_error("echo server hung up");
+                    }
+                    off += r;
+                }
+                result.samples.record(ns_since(sent));
+            }
+            Async::close(fd);
+            if (++done == connections) {
+                shutdown(listener, SHUT_RDWR);
+            }
+        }, StackMode::SHARED);
+    }
+
+    start = Clock::now();
+    scheduler_run(sched);
+    result.seconds = ns_since(start) / 1e9;
+    result.ops = connections * requests;
+    close(listener);
+    return result;
+}
+
+void print(const Result &result) {
+    auto ns = result.seconds * 1e9 / std::max<uint64_t>(result.ops, 1);
+    std::cout << std::left << std::setw(16) << result.name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/op"
+              << std::setw(14) << std::setprecision(0) << 1e9 / ns << " ops/s"
+              << "  p50 " << result.samples.percentile(0.5)
+              << "  p99 " << result.samples.percentile(0.99)
+              << "  max " << result.samples.max() << " ns" << std::endl;
+}
+
+void write_json(const std::vector<Result> &results, std::ostream &out) {
+    out << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i != results.size(); ++i) {
+        auto &result = results[i];
+        auto ns = result.seconds * 1e9 / std::max<uint64_t>(result.ops, 1);
+        out << "    {\"name\": \"" << result.name << "\""
+            << ", \"ops\": " << result.ops
+            << ", \"seconds\": " << result.seconds
+            << ", \"ns_per_op\": " << ns
+            << ", \"ops_per_sec\": " << 1e9 / ns
+            << ", \"p50_ns\": " << result.samples.percentile(0.5)
+            << ", \"p90_ns\": " << result.samples.percentile(0.9)
+            << ", \"p99_ns\": " << result.samples.percentile(0.99)
+            << ", \"max_ns\": " << result.samples.max() << "}"
+            << (i + 1 != results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+/// Echo with many connections needs two fds per connection
+size_t max_connections(size_t wanted) {
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return std::min<size_t>(wanted, (limit.rlim_cur - 64) / 2);
+}
+
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            options.json = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--quick") {
+            options.quick = true;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--json PATH] [--filter SUBSTRING] [--quick]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<std::pair<std::string, std::function<Result()>>> cases = {
+            {"switch", bench_switch},
+            {"spawn", bench_spawn},
+            {"task", bench_task},
+            {"yield/2", []() { return bench_yield(2); }},
+            {"yield/100", []() { return bench_yield(100); }},
+            {"yield/10000", []() { return bench_yield(10000); }},
+            {"when_all", bench_when_all},
+            {"stack_pool", bench_stack_pool},
+            {"echo/1", []() { return bench_echo(1, scaled(20000)); }},
+            {"echo/100", []() { return bench_echo(100, scaled(1000)); }},
+            {"echo/1000", []() { return bench_echo(max_connections(1000), scaled(100)); }},
+            {"echo/10000", []() { return bench_echo(max_connections(10000), scaled(10)); }},
+    };
+
+    std::vector<Result> results;
+    for (auto &[name, run] : cases) {
+        if (name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        results.push_back(run());
+        print(results.back());
+    }
+
+    if (!options.json.empty()) {
+        std::ofstream out(options.json);
+        write_json(results, out);
+        if (!out) {
+            std::cerr << "can not write " << options.json << std::endl;
+            return 1;
+        }
+    }
+}
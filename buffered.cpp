@@ -0,0 +1,195 @@
+#include "buffered.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse2")))
+    const char *find_sse2(const char *data, size_t size, char delim) {
+        auto needle = _mm_set1_epi8(delim);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            if (auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle))) {
+                return data + i + __builtin_ctz(mask);
+            }
+        }
+        return static_cast<const char *>(memchr(data + i, delim, size - i));
+    }
+
+    __attribute__((target("avx2")))
+    const char *find_avx2(const char *data, size_t size, char delim) {
+        auto needle = _mm256_set1_epi8(delim);
+        size_t i = 0;
+        /// Two vectors a step keep both load ports busy on long lines
+        for (; i + 64 <= size; i += 64) {
+            auto lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            auto hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+            auto eq_lo = _mm256_cmpeq_epi8(lo, needle);
+            auto eq_hi = _mm256_cmpeq_epi8(hi, needle);
+            if (!_mm256_testz_si256(_mm256_or_si256(eq_lo, eq_hi), _mm256_or_si256(eq_lo, eq_hi))) {
+                auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(eq_lo));
+                if (mask) {
+                    return data + i + __builtin_ctz(mask);
+                }
+                return data + i + 32 + __builtin_ctz(static_cast<uint32_t>(_mm256_movemask_epi8(eq_hi)));
+            }
+        }
+        for (; i + 32 <= size; i += 32) {
+            auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            if (auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)))) {
+                return data + i + __builtin_ctz(mask);
+            }
+        }
+        return find_sse2(data + i, size - i, delim);
+    }
+#endif
+
+    const char *find_memchr(const char *data, size_t size, char delim) {
+        return static_cast<const char *>(memchr(data, delim, size));
+    }
+
+    using Find = const char *(*)(const char *data, size_t size, char delim);
+
+    Find select_find() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &find_avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return &find_sse2;
+        }
+#endif
+        return &find_memchr;
+    }
+
+    const Find find_impl = select_find();
+
+}
+
+namespace Async {
+
+    const char *find_delimiter(const char *data, size_t size, char delim) {
+        return find_impl(data, size, delim);
+    }
+
+    BufferedReader::BufferedReader(int fd, size_t capacity)
+        : fd(fd), capacity(capacity ? capacity : 1), buf(new char[this->capacity]) {
+    }
+
+    std::optional<std::string_view> BufferedReader::read_until(char delim) {
+        while (true) {
+            auto *from = buf.get() + begin + scanned;
+            if (auto *found = find_delimiter(from, end - begin - scanned, delim)) {
+                std::string_view line(buf.get() + begin, found - (buf.get() + begin));
+                begin += line.size() + 1;
+                scanned = 0;
+                return line;
+            }
+            scanned = end - begin;
+            if (!fill()) {
+                if (begin == end) {
+                    return std::nullopt;
+                }
+                std::string_view rest(buf.get() + begin, end - begin);
+                begin = end;
+                scanned = 0;
+                return rest;
+            }
+        }
+    }
+
+    size_t BufferedReader::read_exact(char *out, size_t size) {
+        size_t done = std::min(size, end - begin);
+        memcpy(out, buf.get() + begin, done);
+        begin += done;
+        scanned = 0;
+        while (done != size && !eof) {
+            if (size - done >= capacity) {
+                auto r = Async::read(fd, out + done, size - done);
+                if (r == 0) {
+                    eof = true;
+                }
+                done += r;
+                continue;
+            }
+            if (!fill()) {
+                break;
+            }
+            auto n = std::min(size - done, end - begin);
+            memcpy(out + done, buf.get() + begin, n);
+            begin += n;
+            done += n;
+        }
+        return done;
+    }
+
+    bool BufferedReader::fill() {
+        if (eof) {
+            return false;
+        }
+        if (begin == end) {
+            begin = end = 0;
+        } else if (end == capacity) {
+            if (begin == 0) {
+                throw std::length_error("BufferedReader: no delimiter within capacity");
+            }
+            memmove(buf.get(), buf.get() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        auto r = Async::read(fd, buf.get() + end, capacity - end);
+        if (r == 0) {
+            eof = true;
+            return false;
+        }
+        end += r;
+        return true;
+    }
+
+    BufferedWriter::BufferedWriter(int fd, size_t capacity)
+        : fd(fd), capacity(capacity ? capacity : 1), buf(new char[this->capacity]) {
+    }
+
+    void BufferedWriter::write(std::string_view data) {
+        if (data.size() <= capacity - size) {
+            memcpy(buf.get() + size, data.data(), data.size());
+            size += data.size();
+            return;
+        }
+        iovec iov[2] = {
+            {buf.get(), size},
+            {const_cast<char *>(data.data()), data.size()},
+        };
+        int first = 0;
+        while (first != 2) {
+            auto written = static_cast<size_t>(Async::writev(fd, iov + first, 2 - first));
+            for (; first != 2 && written >= iov[first].iov_len; ++first) {
+                written -= iov[first].iov_len;
+            }
+            if (first != 2) {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+        size = 0;
+    }
+
+    void BufferedWriter::flush() {
+        size_t done = 0;
+        while (done != size) {
+            done += Async::write(fd, buf.get() + done, size - done);
+        }
+        size = 0;
+    }
+
+}
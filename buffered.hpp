@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include "runtime.hpp"
+
+namespace Async {
+
+    /// First delim in [data, data + size) or nullptr. Compares 64 bytes a step
+    /// (two vectors) with AVX2 or 16 with SSE2, picked once by cpuid.
+    const char *find_delimiter(const char *data, size_t size, char delim);
+
+    /// Reads fd with Async::read into a sliding window buffer. Lines are
+    /// returned as views into the buffer, valid till the next call on reader.
+    /// Unread bytes are moved to the front only when the tail is full.
+    class BufferedReader {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        explicit BufferedReader(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+        BufferedReader(const BufferedReader &other) = delete;
+        void operator=(const BufferedReader &other) = delete;
+
+        /// Bytes up to delim, delim is consumed but not included. Rest of the
+        /// stream without delim at EOF, nullopt when nothing is left. Throws
+        /// std::length_error if no delim in capacity bytes.
+        std::optional<std::string_view> read_until(char delim);
+
+        std::optional<std::string_view> read_line() {
+            return read_until('\n');
+        }
+
+        /// Fill buf completely, returns less than size only at EOF.
+        /// Large reads past the buffered bytes go straight to buf.
+        size_t read_exact(char *buf, size_t size);
+
+        /// Bytes read from fd and not consumed yet
+        std::string_view buffered() const {
+            return {buf.get() + begin, end - begin};
+        }
+
+    private:
+        /// Read more into the tail, false at EOF
+        bool fill();
+
+        int fd;
+        size_t capacity;
+        std::unique_ptr<char[]> buf;
+        size_t begin = 0;
+        size_t end = 0;
+        /// Bytes after begin known to have no delim
+        size_t scanned = 0;
+        bool eof = false;
+    };
+
+    /// Collects small writes and sends them with one Async::write. A write
+    /// that does not fit goes out together with the buffer in one writev.
+    /// Not flushed on destruction: call flush(), it may throw.
+    class BufferedWriter {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        explicit BufferedWriter(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+        BufferedWriter(const BufferedWriter &other) = delete;
+        void operator=(const BufferedWriter &other) = delete;
+
+        void write(std::string_view data);
+
+        void flush();
+
+        size_t buffered() const {
+            return size;
+        }
+
+    private:
+        int fd;
+        size_t capacity;
+        std::unique_ptr<char[]> buf;
+        size_t size = 0;
+    };
+
+}
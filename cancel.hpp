@@ -0,0 +1,143 @@
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "scheduler.hpp"
+
+/// Cancellation of fibers of one scheduler thread. A fiber bound to a
+/// cancelled token gets Cancelled thrown from the suspension point it is
+/// parked in (io, timers, sync primitives, yield) and from every later one,
+/// so it unwinds with its destructors run. Not thread safe: cancel from
+/// the thread running the bound fibers.
+
+/// Thrown into cancelled fibers. Not an std::exception, so handlers of
+/// errors do not swallow it. A fiber ending with it ends normally.
+class Cancelled {
+};
+
+struct CancelState {
+    bool cancelled = false;
+    /// Bound contexts, each knows its index
+    std::vector<Context *> fibers;
+};
+
+class CancelToken {
+public:
+    CancelToken() : state(std::make_shared<CancelState>()) {
+    }
+
+    /// Wake bound fibers parked now with Cancelled, idempotent
+    void cancel() const;
+
+    bool cancelled() const {
+        return state->cancelled;
+    }
+
+    /// Bind running fiber, replaces the token it was bound to
+    void attach() const {
+        attach(FiberScheduler::current());
+    }
+
+    /// Bind context, e.g. one not scheduled yet
+    void attach(Context &context) const;
+
+    /// Unbind context from its token
+    static void detach(Context &context);
+
+    /// Throw Cancelled if the running fiber is cancelled, for long
+    /// computations without suspension points
+    static void check();
+
+private:
+    std::shared_ptr<CancelState> state;
+};
+
+/// Running fiber ignores cancellation while the shield lives, for cleanup
+/// which must not be interrupted. Parked shielded fibers are left parked.
+class CancelShield {
+public:
+    CancelShield() : context(FiberScheduler::current()) {
+        ++context.cancel_shield;
+    }
+
+    CancelShield(const CancelShield &other) = delete;
+    void operator=(const CancelShield &other) = delete;
+
+    ~CancelShield() {
+        --context.cancel_shield;
+    }
+
+private:
+    Context &context;
+};
+
+/// Scope owning the fibers it spawns: the scope does not end before all of
+/// them did. The first exception of a child cancels its siblings and is
+/// rethrown by join(). Leaving the scope without join() cancels the
+/// children and waits for them, their error is dropped.
+///
+///     Nursery nursery;
+///     nursery.spawn([&]() { ... });
+///     nursery.spawn([&]() { ... });
+///     nursery.join();
+///
+/// Children run on the scheduler of the current thread. They update state
+/// shared with the nursery, not the nursery object, so it may live on the
+/// stack of a StackMode::SHARED fiber.
+class Nursery {
+public:
+    Nursery() : state(std::make_shared<State>()) {
+    }
+
+    Nursery(const Nursery &other) = delete;
+    void operator=(const Nursery &other) = delete;
+
+    ~Nursery();
+
+    template <class F>
+    void spawn(F &&fiber, StackMode mode = StackMode::PRIVATE) {
+        auto context = FiberScheduler::create_context_from_fiber(
+                [state = state, fiber = std::forward<F>(fiber)]() mutable {
+                    try {
+                        fiber();
+                    } catch (const Cancelled &) {
+                    } catch (...) {
+                        state->failed(std::current_exception());
+                    }
+                    state->finished();
+                }, mode);
+        state->token.attach(*context);
+        ++state->running;
+        FiberScheduler::resume(std::move(context));
+    }
+
+    /// Park till all children ended, rethrow the first error of them
+    void join();
+
+    /// Cancel all children, including ones spawned later
+    void cancel() {
+        state->token.cancel();
+    }
+
+    /// Children not ended yet
+    size_t size() const {
+        return state->running;
+    }
+
+private:
+    struct State {
+        void failed(std::exception_ptr exception);
+
+        void finished();
+
+        CancelToken token;
+        size_t running = 0;
+        std::exception_ptr error;
+        ContextQueue joiners;
+    };
+
+    std::shared_ptr<State> state;
+};
@@ -0,0 +1,109 @@
+#include "connection_pool.hpp"
+
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace {
+
+    /// Idle socket must have nothing to read: EOF, reset or stray bytes make it unusable
+    bool alive(int fd) {
+        char byte;
+        auto r = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    template <class T>
+    void append(std::string &key, const T &field) {
+        key.append(reinterpret_cast<const char *>(&field), sizeof(field));
+    }
+
+    /// Family, port and address of the peer: padding and flow labels of
+    /// equal addresses may differ
+    std::string peer_key(const sockaddr * addr, socklen_t addrlen) {
+        std::string key;
+        append(key, addr->sa_family);
+        if (addr->sa_family == AF_INET && addrlen >= sizeof(sockaddr_in)) {
+            auto *in = reinterpret_cast<const sockaddr_in *>(addr);
+            append(key, in->sin_port);
+            append(key, in->sin_addr);
+        } else if (addr->sa_family == AF_INET6 && addrlen >= sizeof(sockaddr_in6)) {
+            auto *in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+            append(key, in6->sin6_port);
+            append(key, in6->sin6_addr);
+            /// Link-local addresses are only equal on the same interface
+            append(key, in6->sin6_scope_id);
+        } else {
+            key.assign(reinterpret_cast<const char *>(addr), addrlen);
+        }
+        return key;
+    }
+
+}
+
+namespace Async {
+
+    Connection::~Connection() {
+        if (socket >= 0) {
+            Async::close(socket);
+        }
+    }
+
+    void Connection::release() {
+        if (socket < 0) {
+            return;
+        }
+        if (pool) {
+            pool->put(std::move(key), socket);
+        } else {
+            Async::close(socket);
+        }
+        socket = -1;
+    }
+
+    ConnectionPool::~ConnectionPool() {
+        for (auto &[key, idle] : pools) {
+            for (auto &connection : idle) {
+                Async::close(connection.fd);
+            }
+        }
+    }
+
+    Connection ConnectionPool::acquire(const sockaddr * addr, socklen_t addrlen) {
+        auto key = peer_key(addr, addrlen);
+        auto it = pools.find(key);
+        if (it != pools.end()) {
+            auto &idle = it->second;
+            auto now = Clock::now();
+            /// Most recently released first, it is the least likely to be timed out by peer
+            while (!idle.empty()) {
+                auto connection = idle.back();
+                idle.pop_back();
+                --idle_count;
+                if (now - connection.since <= options.idle_timeout && alive(connection.fd)) {
+                    return Connection(this, std::move(key), connection.fd);
+                }
+                Async::close(connection.fd);
+            }
+        }
+        auto fd = Async::connect(addr, addrlen, options.connect_timeout);
+        ++connect_count;
+        return Connection(this, std::move(key), fd);
+    }
+
+    void ConnectionPool::put(std::string key, int fd) {
+        if (options.max_idle == 0) {
+            Async::close(fd);
+            return;
+        }
+        auto &idle = pools[std::move(key)];
+        if (idle.size() == options.max_idle) {
+            Async::close(idle.front().fd);
+            idle.erase(idle.begin());
+            --idle_count;
+        }
+        idle.push_back({fd, Clock::now()});
+        ++idle_count;
+    }
+
+}
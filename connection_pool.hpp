@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "runtime.hpp"
+
+namespace Async {
+
+    class ConnectionPool;
+
+    /// Pooled socket owned by one fiber. Closed on destruction unless given
+    /// back with release(): a connection dropped mid exchange is not reusable.
+    class Connection {
+    public:
+        Connection() = default;
+
+        Connection(Connection &&other) noexcept
+            : pool(other.pool), key(std::move(other.key)), socket(other.socket) {
+            other.socket = -1;
+        }
+
+        Connection &operator=(Connection &&other) noexcept {
+            std::swap(pool, other.pool);
+            std::swap(key, other.key);
+            std::swap(socket, other.socket);
+            return *this;
+        }
+
+        ~Connection();
+
+        int fd() const {
+            return socket;
+        }
+
+        explicit operator bool() const {
+            return socket >= 0;
+        }
+
+        /// Return idle connection to the pool for other fibers
+        void release();
+
+    private:
+        friend class ConnectionPool;
+
+        Connection(ConnectionPool *pool, std::string key, int socket)
+            : pool(pool), key(std::move(key)), socket(socket) {
+        }
+
+        ConnectionPool *pool = nullptr;
+        std::string key;
+        int socket = -1;
+    };
+
+    /// Idle outbound connections keyed by peer family, port and address.
+    /// One pool serves fibers of one scheduler thread, it is not thread
+    /// safe: give each ThreadPerCore core its own. Idle sockets closed by
+    /// the peer are detected with a non-blocking peek and dropped on acquire.
+    class ConnectionPool {
+    public:
+        struct Options {
+            /// Idle connections kept per address, extra ones are closed
+            size_t max_idle = 16;
+            /// Idle connections older than this are closed instead of reused
+            Clock::duration idle_timeout = std::chrono::seconds(30);
+            Clock::duration connect_timeout = std::chrono::seconds(5);
+        };
+
+        ConnectionPool() : ConnectionPool(Options()) {
+        }
+
+        explicit ConnectionPool(Options options) : options(options) {
+        }
+
+        ConnectionPool(const ConnectionPool &other) = delete;
+        void operator=(const ConnectionPool &other) = delete;
+
+        /// Closes idle connections, acquired ones must be gone already
+        ~ConnectionPool();
+
+        /// Live idle connection to addr or a new one by Async::connect
+        Connection acquire(const sockaddr * addr, socklen_t addrlen);
+
+        size_t idle() const {
+            return idle_count;
+        }
+
+        /// Connections made by acquire and not taken from pool
+        size_t connects() const {
+            return connect_count;
+        }
+
+    private:
+        friend class Connection;
+
+        struct Idle {
+            int fd;
+            Clock::time_point since;
+        };
+
+        void put(std::string key, int fd);
+
+        Options options;
+        std::unordered_map<std::string, std::vector<Idle>> pools;
+        size_t idle_count = 0;
+        size_t connect_count = 0;
+    };
+
+}
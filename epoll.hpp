@@ -1,77 +1,163 @@
+#pragma once
+
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <sys/socket.h>
-
-#include "scheduler.hpp"
-
-struct ReadData {
-    int fd;
-    char * data;
-    size_t size;
-};
-
-struct WriteData {
-    int fd;
-    const char * data;
-    size_t size;
-};
-
-struct AcceptData {
-    int fd;
-    sockaddr * addr;
-    socklen_t * addrlen;
-};
-
-class EpollScheduler : public FiberScheduler {
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "io_scheduler.hpp"
+
+/// Fds are registered once with EPOLLIN | EPOLLOUT | EPOLLET and switched to
+/// O_NONBLOCK on first use. Readiness is cached per fd from edges and
+/// cleared on EAGAIN, so read/write/accept on a ready fd make no epoll_ctl.
+/// Fds must be closed with Async::close, else a reused number keeps stale state.
+class EpollScheduler : public IoScheduler {
 private:
     struct Node;
 
-    using Callback = void (EpollScheduler::*)(Node node);
+    using Callback = void (EpollScheduler::*)(Node *node);
 
-    struct Node {
-        Context context;
-        int fd;
+    /// Parked operation, pooled for stable addresses of its timer
+    struct Node : TimingWheel::Timer {
+        ContextPtr context;
+        int fd = -1;
         YieldData data;
         Callback callback = nullptr;
+        TimingWheel::Clock::time_point deadline;
+        EpollScheduler *scheduler = nullptr;
+
+        Node() : TimingWheel::Timer(&EpollScheduler::expire) {
+        }
     };
 
-    struct Events {
-        std::optional<Node> in;
-        std::optional<Node> out;
+    struct FdState {
+        Node *in = nullptr;
+        Node *out = nullptr;
+        bool registered = false;
+        bool readable = false;
+        bool writable = false;
     };
 
 public:
-    /// Start scheduler event loop
-    friend void scheduler_run(EpollScheduler &sched);  // TODO
+    enum {
+        MAX_EVENTS = 256,
+    };
 
-    EpollScheduler() {
+    struct Options {
+        /// Events harvested by one epoll_wait
+        size_t max_events = MAX_EVENTS;
+        /// Spin with zero timeout up to this long once fibers are drained before
+        /// blocking. The window adapts: halves on idle spins, grows when spins catch events.
+        std::chrono::microseconds busy_poll{0};
+        /// SO_BUSY_POLL for accepted sockets in microseconds, 0 is off. Best effort:
+        /// values above net.core.busy_poll need CAP_NET_ADMIN.
+        int socket_busy_poll = 0;
+    };
+
+    struct Stats {
+        /// epoll_wait calls which could block
+        size_t waits = 0;
+        /// Zero timeout epoll_wait calls, between batches and while spinning
+        size_t polls = 0;
+        size_t events = 0;
+        size_t max_batch = 0;
+    };
+
+    EpollScheduler() : EpollScheduler(Options()) {
+    }
+
+    explicit EpollScheduler(Options options) : options(options), events(std::max<size_t>(options.max_events, 1)) {
         epoll_fd = epoll_create1(0);
         if (epoll_fd < 0) {
             throw std::runtime_error("Can not create epoll");
         }
+        spin_window = options.busy_poll;
     }
 
     ~EpollScheduler() override {
         close(epoll_fd);
     }
 
-    void await_read(Context context, YieldData data);  // TODO
+    void await_read(ContextPtr context, YieldData data) override;
+
+    void do_read(Node *node);
 
-    void do_read(Node node);  // TODO
+    void await_write(ContextPtr context, YieldData data) override;
 
-    void await_write(Context context, YieldData data);  // TODO
+    void do_write(Node *node);
 
-    void do_write(Node node);  // TODO
+    void await_accept(ContextPtr context, YieldData data) override;
 
-    void await_accept(Context context, YieldData data);  // TODO
+    void do_accept(Node *node);
 
-    void do_accept(Node node);  // TODO
+    void await_poll(ContextPtr context, YieldData data) override;
 
-    void do_error(Node node);  // TODO
+    void do_ready(Node *node);
 
-    void run() override;  // TODO
+    void do_error(Node *node);
+
+    void do_timeout(Node *node);
+
+    void forget(int fd) override;
+
+    void accepted(int fd) override;
+
+    bool ready_hint(int fd, uint32_t events) override;
+
+    void clear_hint(int fd, uint32_t events) override;
+
+    void run() override;
+
+    const Stats &stats() const {
+        return stats_;
+    }
 
 private:
-    std::unordered_map<int, Events> wait_list;
+    /// Harvest edges and run parked operations, timeout as in epoll_wait
+    int harvest(int timeout);
+
+    /// Zero timeout harvests till events, ready fibers or end of the adaptive window
+    bool busy_poll();
+
+    Node *make_node(ContextPtr context, int fd, YieldData data, Callback callback,
+                    TimingWheel::Clock::time_point deadline);
+
+    /// Schedule node context and recycle node
+    void finish(Node *node);
+
+    FdState &fd_state(int fd);
+
+    /// Add fd to epoll once, false if it can not be polled
+    bool register_fd(int fd, FdState &state);
+
+    /// Finish node with an error if its fd is invalid or slot is taken,
+    /// throwing would leak the node and its context
+    bool rejected(Node *node, Node *FdState::*slot);
+
+    /// Park node in slot of its fd till the next edge, do_error if fd can not be polled
+    void park(Node *node, Node *FdState::*slot);
+
+    /// Take node from slot of fd
+    Node *unpark(int fd, Node *FdState::*slot);
+
+    /// Timer callback of parked node
+    static void expire(TimingWheel::Timer &timer, void *owner);
+
+    /// Unpark hook of parked node: finish it with Cancelled
+    static void cancel(Context &context, void *owner);
+
+    /// Indexed by fd
+    std::vector<FdState> fds;
+    /// deque keeps addresses stable, nodes are reused through free list
+    std::deque<Node> nodes;
+    std::vector<Node *> free_nodes;
+    size_t parked = 0;
+    Options options;
+    Stats stats_;
+    std::vector<epoll_event> events;
+    std::chrono::microseconds spin_window{0};
     int epoll_fd;
 };
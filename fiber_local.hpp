@@ -0,0 +1,68 @@
+#pragma once
+
+#include <utility>
+
+#include "scheduler.hpp"
+
+/// Per-fiber value of T, like thread_local for fibers. Define instances with
+/// static storage duration: each takes one of FiberLocals::MAX_SLOTS slots
+/// for the lifetime of the program. Access is a thread local load and an
+/// index, valid on fibers only. The value is constructed on first access in
+/// the fiber, in place (see FiberLocals), and destroyed on the fiber when it
+/// ends.
+template <class T>
+class FiberLocal {
+public:
+    FiberLocal() : slot(FiberLocals::allocate(&destroy)) {
+    }
+
+    FiberLocal(const FiberLocal &other) = delete;
+    void operator=(const FiberLocal &other) = delete;
+
+    /// Value of the running fiber, default constructed on first access
+    T &get() const {
+        auto &locals = *FiberLocals::running();
+        if (!locals.has(slot)) [[unlikely]] {
+            return locals.emplace<T>(slot);
+        }
+        return *locals.get<T>(slot);
+    }
+
+    T &operator*() const {
+        return get();
+    }
+
+    T *operator->() const {
+        return &get();
+    }
+
+    /// Replace value of the running fiber
+    template <class... Args>
+    T &emplace(Args &&... args) const {
+        auto &locals = *FiberLocals::running();
+        locals.reset(slot);
+        return locals.emplace<T>(slot, std::forward<Args>(args)...);
+    }
+
+    /// Running fiber accessed the value already
+    bool has_value() const {
+        return FiberLocals::running()->has(slot);
+    }
+
+    void reset() const {
+        FiberLocals::running()->reset(slot);
+    }
+
+private:
+    static void destroy(void *value, bool heap) {
+        auto *typed = static_cast<T *>(value);
+        if constexpr (!FiberLocals::IN_SLOT<T>) {
+            typed->~T();
+            if (heap) {
+                ::operator delete(typed, std::align_val_t(alignof(T)));
+            }
+        }
+    }
+
+    size_t slot;
+};
@@ -1,14 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <cinttypes>
+#include <cstddef>
 #include <stdexcept>
 #include <memory>
+#include <new>
 #include <optional>
+#include <type_traits>
+#include <utility>
 
 #include "stack_pool.hpp"
 
 
 using Fiber = std::function<void()>;
 
+/// Run queue class, FiberScheduler serves them weighted 16:4:1
+enum class Priority : uint8_t {
+    /// Health checks, control plane
+    HIGH,
+    NORMAL,
+    /// Bulk and background work
+    LOW,
+};
+
+enum class StackMode {
+    /// Own stack from stack_pool
+    PRIVATE,
+    /// Run on the scheduler shared stack, used part is copied out on every
+    /// switch. Memory of a parked fiber equals its real stack depth, but its
+    /// stack objects must not be accessed by others while it is parked.
+    /// Short fibers that never park cost no stack allocation and no copy.
+    SHARED,
+};
+
 union YieldData {
     void * ptr = {};
     int32_t i;
@@ -28,27 +55,297 @@ struct Action {
         /// Fiber -> Scheduler
         STOP,
         SCHED,
+        WAIT,  /// user_data points to FiberScheduler::Wait
     } action;
 
     YieldData user_data{};
 };
 
 
+/// Type erased fiber body without heap allocation. Small callables are kept
+/// inline till the fiber gets its stack and are moved to the stack top then.
+class Closure {
+public:
+    static constexpr size_t INLINE_SIZE = 64;
+
+    enum class Op {
+        RUN,
+        /// Move construct to `to` and destroy object
+        MOVE,
+        DESTROY,
+    };
+
+    using Ops = void (*)(Op op, void *object, void *to);
+
+    /// Lies above the callable on the fiber stack, trampoline argument
+    struct Entry {
+        Ops ops;
+        void *object;
+    };
+
+    template <class F>
+    static constexpr bool fits_inline = sizeof(F) <= INLINE_SIZE && alignof(F) <= alignof(std::max_align_t);
+
+    template <class F>
+    static void ops_of(Op op, void *object, void *to) {
+        auto *f = static_cast<F *>(object);
+        switch (op) {
+            case Op::RUN:
+                (*f)();
+                break;
+            case Op::MOVE:
+                new (to) F(std::move(*f));
+                f->~F();
+                break;
+            case Op::DESTROY:
+                f->~F();
+                break;
+        }
+    }
+
+    /// Owns a callable too big to be kept inline
+    template <class F>
+    struct Boxed {
+        std::unique_ptr<F> f;
+
+        void operator()() {
+            (*f)();
+        }
+    };
+
+    Closure() = default;
+
+    template <class F, class T = std::decay_t<F>>
+    explicit Closure(F &&f) : ops_(&ops_of<T>), size_(sizeof(T)), align_(alignof(T)) {
+        static_assert(fits_inline<T>);
+        new (storage) T(std::forward<F>(f));
+    }
+
+    Closure(Closure &&other) noexcept : ops_(other.ops_), size_(other.size_), align_(other.align_) {
+        if (ops_) {
+            ops_(Op::MOVE, other.storage, storage);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Closure &operator=(Closure &&other) noexcept {
+        if (this != &other) {
+            reset();
+            ops_ = std::exchange(other.ops_, nullptr);
+            size_ = other.size_;
+            align_ = other.align_;
+            if (ops_) {
+                ops_(Op::MOVE, other.storage, storage);
+            }
+        }
+        return *this;
+    }
+
+    ~Closure() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return ops_;
+    }
+
+    Ops ops() const {
+        return ops_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t align() const {
+        return align_;
+    }
+
+    /// Move callable to `to` (size and align bytes available), closure becomes empty
+    void place(void *to) {
+        ops_(Op::MOVE, storage, to);
+        ops_ = nullptr;
+    }
+
+private:
+    void reset() {
+        if (ops_) {
+            ops_(Op::DESTROY, storage, nullptr);
+            ops_ = nullptr;
+        }
+    }
+
+    Ops ops_ = nullptr;
+    uint32_t size_ = 0;
+    uint32_t align_ = 0;
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+};
+
+/// Values of FiberLocal slots of one fiber. Slots are numbered at static init
+/// and never reused, values are created on first access and destroyed when
+/// the fiber ends (or its context is reset). Small trivially copyable values
+/// live in the slot itself, others in an arena of the context which is kept
+/// when the context is recycled, or on the heap once the arena is full.
+class FiberLocals {
+public:
+    enum {
+        MAX_SLOTS = 32,
+        ARENA_SIZE = 256,
+    };
+
+    /// Destroys value of a slot, frees it too if it is on the heap
+    using Destroy = void (*)(void *value, bool heap);
+
+    template <class T>
+    static constexpr bool IN_SLOT = sizeof(T) <= sizeof(void *) && alignof(T) <= alignof(void *) &&
+                                    std::is_trivially_copyable_v<T>;
+
+    FiberLocals() = default;
+
+    FiberLocals(FiberLocals &&other) noexcept
+            : used(std::exchange(other.used, 0)), heap(std::exchange(other.heap, 0)),
+              arena(std::move(other.arena)), arena_used(std::exchange(other.arena_used, 0)) {
+        std::copy(std::begin(other.values), std::end(other.values), values);
+    }
+
+    /// Keeps own arena if other has none, so recycled contexts reuse it
+    FiberLocals &operator=(FiberLocals &&other) noexcept {
+        clear();
+        used = std::exchange(other.used, 0);
+        heap = std::exchange(other.heap, 0);
+        if (other.arena) {
+            arena = std::move(other.arena);
+            arena_used = std::exchange(other.arena_used, 0);
+        }
+        std::copy(std::begin(other.values), std::end(other.values), values);
+        return *this;
+    }
+
+    ~FiberLocals() {
+        clear();
+    }
+
+    /// New slot whose values are freed with destroy, throws when all are taken
+    static size_t allocate(Destroy destroy);
+
+    /// Locals of the fiber running on this thread, null outside fibers. Read
+    /// with a fresh %fs relative load each time, so a fiber migrated by a
+    /// work stealing scheduler sees the locals of its new thread's slot.
+    static FiberLocals *running() {
+        return current;
+    }
+
+    bool has(size_t slot) const {
+        return used & (uint32_t(1) << slot);
+    }
+
+    template <class T>
+    T *get(size_t slot) {
+        if constexpr (IN_SLOT<T>) {
+            return std::launder(reinterpret_cast<T *>(&values[slot]));
+        } else {
+            return static_cast<T *>(values[slot]);
+        }
+    }
+
+    /// Construct value of an empty slot
+    template <class T, class... Args>
+    T &emplace(size_t slot, Args &&... args) {
+        auto bit = uint32_t(1) << slot;
+        T *value;
+        if constexpr (IN_SLOT<T>) {
+            value = new (&values[slot]) T(std::forward<Args>(args)...);
+        } else if (auto *memory = take(sizeof(T), alignof(T))) {
+            value = new (memory) T(std::forward<Args>(args)...);
+            values[slot] = value;
+        } else {
+            auto *block = ::operator new(sizeof(T), std::align_val_t(alignof(T)));
+            try {
+                value = new (block) T(std::forward<Args>(args)...);
+            } catch (...) {
+                ::operator delete(block, std::align_val_t(alignof(T)));
+                throw;
+            }
+            values[slot] = value;
+            heap |= bit;
+        }
+        used |= bit;
+        return *value;
+    }
+
+    /// Destroy value of one slot
+    void reset(size_t slot);
+
+    /// Destroy all values, last slot first
+    void clear();
+
+private:
+    friend class FiberScheduler;
+
+    /// Bump allocation from the arena, null when it is full
+    void *take(size_t size, size_t align);
+
+    static Destroy destroyers[MAX_SLOTS];
+    static inline thread_local FiberLocals *current __attribute__((tls_model("initial-exec"))) = nullptr;
+
+    uint32_t used = 0;
+    /// Slots whose values are on the heap
+    uint32_t heap = 0;
+    std::unique_ptr<char[]> arena;
+    size_t arena_used = 0;
+    void *values[MAX_SLOTS];
+};
+
 class Watch;
+struct CancelState;
 
 struct Context {
-    std::unique_ptr<Fiber> fiber;
+    /// Link of ContextQueue and of the free list
+    Context *next = nullptr;
+
+    /// Fiber body till the stack is bound, empty afterwards
+    Closure closure;
     StackPool::Stack stack;
 
+    /// Resume address and stack pointer (rip/rsp on x86-64)
     intptr_t eip = 0;
     intptr_t esp = 0;
     std::shared_ptr<Watch> watch;
+    FiberLocals locals;
     std::exception_ptr exception{};
     YieldData yield_data = {};
+    /// Async:: calls completed on the fiber since it last parked
+    uint32_t inline_ops = 0;
 
-    Context() = default;
+    /// Run queue of the fiber, deadline puts it into the EDF tier before all
+    /// classes. Both stay over yields and parks, a fiber may change its own.
+    Priority priority = Priority::NORMAL;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    /// Scheduler dispatch count when queued, for aging
+    uint64_t enqueued = 0;
+
+    /// Coroutine frame of an Async::Task to resume instead of switching to a
+    /// stack, the innermost awaiting one (see task.hpp)
+    void *frame = nullptr;
 
-    explicit Context(Fiber fiber);
+    /// Set by the owner of a parked context (io backend, wait queue): takes
+    /// it back and resumes it with Cancelled. Cleared when it is scheduled.
+    void (*unpark)(Context &context, void *owner) = nullptr;
+    void *unpark_owner = nullptr;
+    /// CancelToken the fiber is bound to, index in its list of fibers
+    std::shared_ptr<CancelState> cancel;
+    uint32_t cancel_index = 0;
+    /// Active CancelShields
+    uint32_t cancel_shield = 0;
+
+    /// StackMode::SHARED: stack contents between runs and the scheduler owning the stack
+    std::unique_ptr<char[]> saved_stack;
+    size_t saved_size = 0;
+    size_t saved_capacity = 0;
+    const void *shared_owner = nullptr;
+    bool shared_stack = false;
+
+    Context() = default;
 
     Context(Context &&other) = default;
 
@@ -59,13 +356,106 @@ struct Context {
     void operator=(const Context &other) = delete;
 
     /// swap current eip and esp
-    Action switch_context(Action);  // TODO
+    Action switch_context(Action);
+
+    /// Copy size bytes of stack image to saved_stack, reusing the buffer if it fits
+    void save_stack(const void *from, size_t size);
+};
+
+/// Returns context to the free list of current thread
+struct ContextDeleter {
+    void operator()(Context *context) const;
+};
+
+/// Contexts keep one address from schedule till exit: only the pointer moves
+/// between queues, and spawning reuses freed contexts instead of allocating
+using ContextPtr = std::unique_ptr<Context, ContextDeleter>;
+
+/// Empty context, recycled if possible
+ContextPtr make_context();
+
+/// Intrusive FIFO of owned contexts
+class ContextQueue {
+public:
+    ContextQueue() = default;
+
+    ContextQueue(const ContextQueue &other) = delete;
+    void operator=(const ContextQueue &other) = delete;
+
+    ~ContextQueue() {
+        while (!empty()) {
+            pop();
+        }
+    }
+
+    bool empty() const {
+        return !head;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    Context &front() const {
+        return *head;
+    }
+
+    /// Take context out of the middle, linear
+    ContextPtr remove(Context *context) {
+        Context *prev = nullptr;
+        for (auto *it = head; it != context; it = it->next) {
+            prev = it;
+        }
+        (prev ? prev->next : head) = context->next;
+        if (tail == context) {
+            tail = prev;
+        }
+        context->next = nullptr;
+        --size_;
+        return ContextPtr(context);
+    }
+
+    void push(ContextPtr context) {
+        auto *raw = context.release();
+        raw->next = nullptr;
+        if (tail) {
+            tail->next = raw;
+        } else {
+            head = raw;
+        }
+        tail = raw;
+        ++size_;
+    }
+
+    ContextPtr pop() {
+        auto *raw = head;
+        head = raw->next;
+        if (!head) {
+            tail = nullptr;
+        }
+        raw->next = nullptr;
+        --size_;
+        return ContextPtr(raw);
+    }
+
+private:
+    Context *head = nullptr;
+    Context *tail = nullptr;
+    size_t size_ = 0;
 };
 
 class Watch {
 public:
     virtual ~Watch() = default;
 
+    /// Context is about to run a slice
+    virtual void resumed(Context &) {
+    }
+
+    /// Context became runnable: yielded, woken up or its io completed
+    virtual void scheduled(Context &) {
+    }
+
     /// Inspect context after execution
     virtual void operator()(Action &, Context &) = 0;
 };
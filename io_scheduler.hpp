@@ -0,0 +1,119 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <deque>
+
+#include "scheduler.hpp"
+#include "timer.hpp"
+
+/// Thrown from Async:: calls which did not complete before their deadline
+class TimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct ReadData {
+    int fd;
+    char * data;
+    size_t size;
+    TimingWheel::Clock::time_point deadline = TimingWheel::Clock::time_point::max();
+};
+
+struct WriteData {
+    int fd;
+    const char * data;
+    size_t size;
+    TimingWheel::Clock::time_point deadline = TimingWheel::Clock::time_point::max();
+};
+
+struct AcceptData {
+    int fd;
+    sockaddr * addr;
+    socklen_t * addrlen;
+    TimingWheel::Clock::time_point deadline = TimingWheel::Clock::time_point::max();
+};
+
+struct PollData {
+    int fd;
+    /// EPOLLIN or EPOLLOUT, same values as POLLIN and POLLOUT
+    uint32_t events;
+    TimingWheel::Clock::time_point deadline = TimingWheel::Clock::time_point::max();
+};
+
+/// Event loop backend of Async:: calls. await_* take ownership of suspended
+/// context and schedule it back with result in yield_data or with exception.
+/// Operations with finite deadline are resumed with TimeoutError on expiry.
+class IoScheduler : public FiberScheduler {
+public:
+    /// Start scheduler event loop
+    friend void scheduler_run(IoScheduler &sched);
+
+    /// Scheduler running on this thread, throws if none
+    static IoScheduler &running();
+
+    /// data points to ReadData
+    virtual void await_read(ContextPtr context, YieldData data) = 0;
+
+    /// data points to WriteData
+    virtual void await_write(ContextPtr context, YieldData data) = 0;
+
+    /// data points to AcceptData
+    virtual void await_accept(ContextPtr context, YieldData data) = 0;
+
+    /// Resume fiber once fd is ready, data points to PollData read only during the call
+    virtual void await_poll(ContextPtr context, YieldData data) = 0;
+
+    /// Resume fiber at deadline, data points to TimingWheel::Clock::time_point
+    void await_sleep(ContextPtr context, YieldData data);
+
+    /// Drop state kept for fd before it is closed or its number is reused
+    virtual void forget(int /* fd */) {
+    }
+
+    /// Called for every fd returned by Async::accept and Async::accept_all
+    virtual void accepted(int fd) {
+        forget(fd);
+    }
+
+    /// fd is non-blocking and was ready for events (EPOLLIN or EPOLLOUT) on
+    /// the last try: Async:: calls try the syscall on the fiber before parking
+    virtual bool ready_hint(int /* fd */, uint32_t /* events */) {
+        return false;
+    }
+
+    /// Inline try got EAGAIN
+    virtual void clear_hint(int /* fd */, uint32_t /* events */) {
+    }
+
+    /// Proceed fibers, io and timers till all are empty
+    void run() override = 0;
+
+protected:
+    /// Fire expired timers, their fibers are scheduled
+    void expire_timers() {
+        timers.advance(TimingWheel::Clock::now(), static_cast<IoScheduler *>(this));
+    }
+
+    /// Blocking wait timeout in ms for the nearest timer, -1 if none
+    int wait_timeout() const {
+        return timers.timeout(TimingWheel::Clock::now());
+    }
+
+    /// Timer callbacks get IoScheduler * as owner
+    TimingWheel timers;
+
+private:
+    struct Sleeper : TimingWheel::Timer {
+        ContextPtr context;
+        IoScheduler *scheduler = nullptr;
+    };
+
+    static void wake(TimingWheel::Timer &timer, void *owner);
+
+    /// Unpark hook of sleeping fiber: wake it with Cancelled
+    static void cancel(Context &context, void *owner);
+
+    /// deque keeps addresses stable, sleepers are reused through free list
+    std::deque<Sleeper> sleepers;
+    std::vector<Sleeper *> free_sleepers;
+};
@@ -0,0 +1,399 @@
+#include "runtime.hpp"
+
+#include <poll.h>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace {
+    int io_uring_setup(unsigned entries, io_uring_params *params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                       const void *arg = nullptr, size_t arg_size = 0) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+    }
+
+    int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    template <class T>
+    T *ring_field(void *ring, uint32_t offset) {
+        return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+    }
+
+    [[noreturn]] void throw_errno(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+}
+
+IoUringScheduler::IoUringScheduler(unsigned entries) {
+    io_uring_params params{};
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        throw_errno("io_uring_setup");
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        close(ring_fd);
+        throw_errno("mmap sq ring");
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+            close(ring_fd);
+            throw_errno("mmap cq ring");
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        throw_errno("mmap sqes");
+    }
+
+    sq_head = ring_field<unsigned>(sq_ring, params.sq_off.head);
+    sq_tail = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_entries = ring_field<unsigned>(sq_ring, params.sq_off.ring_entries);
+    sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+
+    cq_head = ring_field<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+IoUringScheduler::~IoUringScheduler() {
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+void IoUringScheduler::register_files(const std::vector<int> &fds) {
+    if (!fixed_files.empty()) {
+        io_uring_register(ring_fd, IORING_UNREGISTER_FILES, nullptr, 0);
+        fixed_files.clear();
+    }
+    if (fds.empty()) {
+        return;
+    }
+    if (io_uring_register(ring_fd, IORING_REGISTER_FILES, fds.data(), fds.size()) < 0) {
+        throw_errno("io_uring_register files");
+    }
+    for (size_t i = 0; i != fds.size(); ++i) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        if (static_cast<size_t>(fds[i]) >= fixed_files.size()) {
+            fixed_files.resize(fds[i] + 1, -1);
+        }
+        fixed_files[fds[i]] = static_cast<int>(i);
+    }
+}
+
+void IoUringScheduler::register_buffers(const std::vector<iovec> &buffers) {
+    if (!fixed_buffers.empty()) {
+        io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        fixed_buffers.clear();
+    }
+    if (buffers.empty()) {
+        return;
+    }
+    if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0) {
+        throw_errno("io_uring_register buffers");
+    }
+    fixed_buffers = buffers;
+}
+
+IoUringScheduler::Request *IoUringScheduler::make_request(ContextPtr context, YieldData data, uint8_t opcode,
+                                                           TimingWheel::Clock::time_point deadline) {
+    Request *request;
+    if (!free_requests.empty()) {
+        request = free_requests.back();
+        free_requests.pop_back();
+    } else {
+        request = &requests.emplace_back();
+        request->expire = &IoUringScheduler::expire;
+    }
+    request->context = std::move(context);
+    request->data = data;
+    request->opcode = opcode;
+    request->timed_out = false;
+    request->cancelled = false;
+    request->scheduler = this;
+    request->context->unpark = &IoUringScheduler::cancel;
+    request->context->unpark_owner = request;
+    if (deadline != TimingWheel::Clock::time_point::max()) {
+        timers.arm(*request, deadline);
+    }
+    return request;
+}
+
+void IoUringScheduler::expire(TimingWheel::Timer &timer, void *owner) {
+    auto &request = static_cast<Request &>(timer);
+    auto *self = static_cast<IoUringScheduler *>(static_cast<IoScheduler *>(owner));
+    request.timed_out = true;
+    self->cancel_in_kernel(request);
+}
+
+void IoUringScheduler::cancel(Context &, void *owner) {
+    auto &request = *static_cast<Request *>(owner);
+    request.cancelled = true;
+    request.scheduler->cancel_in_kernel(request);
+}
+
+void IoUringScheduler::cancel_in_kernel(Request &request) {
+    /// Completion of the cancel itself carries no request and is skipped
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uint64_t>(&request);
+    sqe->user_data = 0;
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+}
+
+io_uring_sqe *IoUringScheduler::get_sqe() {
+    /// Full ring: submit till the kernel really took entries, an SQE must
+    /// not be reused before the head passed it
+    while (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == *sq_entries) {
+        auto submitted = io_uring_enter(ring_fd, to_submit, 0, 0, nullptr, 0);
+        if (submitted > 0) {
+            to_submit -= submitted;
+            continue;
+        }
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted < 0 && errno != EAGAIN && errno != EBUSY) {
+            throw_errno("io_uring_enter");
+        }
+        /// Kernel is short of resources or completions overflowed: free
+        /// some by reaping, waiting for one if none is there yet
+        if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head) {
+            if (in_flight == 0) {
+                throw std::system_error(submitted < 0 ? errno : EBUSY, std::generic_category(),
+                                        "io_uring: submission queue stuck");
+            }
+            if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                throw_errno("io_uring_enter");
+            }
+        }
+        reap();
+    }
+    auto tail = *sq_tail;
+    auto index = tail & *sq_mask;
+    auto *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    return sqe;
+}
+
+void IoUringScheduler::prepare(Request *request) {
+    auto *sqe = get_sqe();
+    sqe->opcode = request->opcode;
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+
+    int fd;
+    const char *buf = nullptr;
+    size_t size = 0;
+    switch (request->opcode) {
+        case IORING_OP_READ: {
+            auto *read_data = static_cast<ReadData *>(request->data.ptr);
+            fd = read_data->fd;
+            buf = read_data->data;
+            size = read_data->size;
+            sqe->off = -1;
+            break;
+        }
+        case IORING_OP_WRITE:
+        case IORING_OP_SEND: {
+            auto *write_data = static_cast<WriteData *>(request->data.ptr);
+            fd = write_data->fd;
+            buf = write_data->data;
+            size = write_data->size;
+            if (request->opcode == IORING_OP_SEND) {
+                /// Report EPIPE as an error instead of killing the process
+                sqe->msg_flags = MSG_NOSIGNAL;
+            } else {
+                sqe->off = -1;
+            }
+            break;
+        }
+        case IORING_OP_ACCEPT: {
+            auto *accept_data = static_cast<AcceptData *>(request->data.ptr);
+            fd = accept_data->fd;
+            sqe->addr = reinterpret_cast<uint64_t>(accept_data->addr);
+            sqe->addr2 = reinterpret_cast<uint64_t>(accept_data->addrlen);
+            break;
+        }
+        case IORING_OP_POLL_ADD:
+            fd = request->poll_fd;
+            sqe->poll32_events = request->poll_events;
+            break;
+        default:
+            throw std::logic_error("Unexpected io_uring opcode");
+    }
+
+    if (fd >= 0 && static_cast<size_t>(fd) < fixed_files.size() && fixed_files[fd] >= 0) {
+        sqe->fd = fixed_files[fd];
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+
+    if (buf) {
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = static_cast<uint32_t>(size);
+        if (request->opcode != IORING_OP_SEND) {
+            for (size_t i = 0; i != fixed_buffers.size(); ++i) {
+                auto *begin = static_cast<const char *>(fixed_buffers[i].iov_base);
+                if (buf >= begin && buf + size <= begin + fixed_buffers[i].iov_len) {
+                    sqe->opcode = request->opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                    sqe->buf_index = static_cast<uint16_t>(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+    ++in_flight;
+}
+
+void IoUringScheduler::await_read(ContextPtr context, YieldData data) {
+    auto deadline = static_cast<ReadData *>(data.ptr)->deadline;
+    prepare(make_request(std::move(context), data, IORING_OP_READ, deadline));
+}
+
+void IoUringScheduler::await_write(ContextPtr context, YieldData data) {
+    auto deadline = static_cast<WriteData *>(data.ptr)->deadline;
+    prepare(make_request(std::move(context), data, IORING_OP_SEND, deadline));
+}
+
+void IoUringScheduler::await_accept(ContextPtr context, YieldData data) {
+    auto deadline = static_cast<AcceptData *>(data.ptr)->deadline;
+    prepare(make_request(std::move(context), data, IORING_OP_ACCEPT, deadline));
+}
+
+void IoUringScheduler::await_poll(ContextPtr context, YieldData data) {
+    auto *poll_data = static_cast<PollData *>(data.ptr);
+    auto *request = make_request(std::move(context), data, IORING_OP_POLL_ADD, poll_data->deadline);
+    request->poll_fd = poll_data->fd;
+    request->poll_events = poll_data->events;
+    prepare(request);
+}
+
+void IoUringScheduler::enter(unsigned min_complete, int timeout) {
+    ++enters;
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+    if (min_complete && timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    auto submitted = io_uring_enter(ring_fd, to_submit, min_complete, flags,
+                                    flags & IORING_ENTER_EXT_ARG ? &arg : nullptr,
+                                    flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if (submitted < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == ETIME) {
+            return;
+        }
+        throw_errno("io_uring_enter");
+    }
+    to_submit -= submitted;
+}
+
+void IoUringScheduler::complete(Request *request, int32_t res) {
+    --in_flight;
+    if (res == -ENOTSOCK && request->opcode == IORING_OP_SEND) {
+        /// Not a socket: plain write
+        request->opcode = IORING_OP_WRITE;
+        prepare(request);
+        return;
+    }
+    if ((res == -EAGAIN || res == -EINTR) && !request->timed_out && !request->cancelled) {
+        prepare(request);
+        return;
+    }
+    timers.disarm(*request);
+    auto &context = request->context;
+    /// Operation completed before the cancel reached it keeps its result
+    if ((res == -ECANCELED || res == -EINTR) && request->cancelled) {
+        context->exception = std::make_exception_ptr(Cancelled());
+    } else if (res == -ECANCELED && request->timed_out) {
+        context->exception = std::make_exception_ptr(TimeoutError("Timeout on io_uring request"));
+    } else if (res < 0) {
+        context->exception = std::make_exception_ptr(std::system_error(-res, std::generic_category(), "io_uring"));
+    } else if (request->opcode == IORING_OP_ACCEPT) {
+        context->yield_data.i = res;
+    } else {
+        context->yield_data.ss = res;
+    }
+    schedule(std::move(context));
+    free_requests.push_back(request);
+}
+
+void IoUringScheduler::reap() {
+    auto head = *cq_head;
+    auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        auto &cqe = cqes[head & *cq_mask];
+        auto *request = reinterpret_cast<Request *>(cqe.user_data);
+        auto res = cqe.res;
+        ++head;
+        /// Release slot before completion: resubmission may need to flush the ring
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (request) {
+            complete(request, res);
+        }
+    }
+}
+
+void IoUringScheduler::run() {
+    while (true) {
+        /// Process all fibers, they only queue SQEs
+        while (!empty()) {
+            run_one();
+        }
+        expire_timers();
+        if (!empty()) {
+            continue;
+        }
+        if (in_flight == 0 && timers.empty()) {
+            break;
+        }
+        /// Submit the whole batch and wait for at least one completion or the nearest timer
+        enter(1, wait_timeout());
+        reap();
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <deque>
+#include <vector>
+
+#include "io_scheduler.hpp"
+
+/// io_uring backend: every Async operation becomes an SQE, fibers are resumed
+/// from CQEs. SQEs prepared by all fibers of one loop iteration are submitted
+/// together with the wait for completions by a single io_uring_enter.
+class IoUringScheduler : public IoScheduler {
+public:
+    enum {
+        DEFAULT_ENTRIES = 256,
+    };
+
+    explicit IoUringScheduler(unsigned entries = DEFAULT_ENTRIES);
+
+    ~IoUringScheduler() override;
+
+    IoUringScheduler(const IoUringScheduler &other) = delete;
+    void operator=(const IoUringScheduler &other) = delete;
+
+    void await_read(ContextPtr context, YieldData data) override;
+
+    void await_write(ContextPtr context, YieldData data) override;
+
+    void await_accept(ContextPtr context, YieldData data) override;
+
+    void await_poll(ContextPtr context, YieldData data) override;
+
+    void run() override;
+
+    /// Register fds with the ring, operations on them skip the fd table lookup.
+    /// Replaces previous registration.
+    void register_files(const std::vector<int> &fds);
+
+    /// Register buffers with the ring, reads and writes lying fully inside
+    /// one of them use READ_FIXED/WRITE_FIXED. Replaces previous registration.
+    void register_buffers(const std::vector<iovec> &buffers);
+
+    /// io_uring_enter calls made by run, for batching statistics
+    size_t enter_calls() const {
+        return enters;
+    }
+
+private:
+    struct Request : TimingWheel::Timer {
+        ContextPtr context;
+        YieldData data;
+        uint8_t opcode = 0;
+        /// IORING_OP_POLL_ADD arguments are copied, data is not kept
+        int poll_fd = -1;
+        uint32_t poll_events = 0;
+        /// Cancelled by its timer
+        bool timed_out = false;
+        /// Cancelled by CancelToken of its fiber
+        bool cancelled = false;
+        IoUringScheduler *scheduler = nullptr;
+    };
+
+    /// Take free request, arm its timer if deadline is finite
+    Request *make_request(ContextPtr context, YieldData data, uint8_t opcode,
+                          TimingWheel::Clock::time_point deadline = TimingWheel::Clock::time_point::max());
+
+    /// Next free SQE, flushes queue to kernel if ring is full
+    io_uring_sqe *get_sqe();
+
+    /// Fill SQE for request, applying fixed file and buffer if registered
+    void prepare(Request *request);
+
+    /// Submit queued SQEs, wait for min_complete CQEs at most timeout ms (-1 forever)
+    void enter(unsigned min_complete, int timeout = -1);
+
+    /// Timer callback: cancel the request in kernel
+    static void expire(TimingWheel::Timer &timer, void *owner);
+
+    /// Unpark hook of a fiber in flight: cancel the request in kernel
+    static void cancel(Context &context, void *owner);
+
+    /// Queue IORING_OP_ASYNC_CANCEL of request
+    void cancel_in_kernel(Request &request);
+
+    void reap();
+
+    void complete(Request *request, int32_t res);
+
+    int ring_fd = -1;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+
+    unsigned to_submit = 0;
+    size_t in_flight = 0;
+    size_t enters = 0;
+
+    /// deque keeps addresses stable, requests are reused through free list
+    std::deque<Request> requests;
+    std::vector<Request *> free_requests;
+
+    /// fd -> index in registered files or -1
+    std::vector<int> fixed_files;
+    std::vector<iovec> fixed_buffers;
+};
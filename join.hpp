@@ -0,0 +1,165 @@
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "scheduler.hpp"
+
+/// Result of a spawned fiber shared by the fiber and its JoinHandle. Fibers
+/// waiting for it are parked, never yield in a loop. Not thread safe, like
+/// sync.hpp primitives.
+class JoinState {
+public:
+    /// Park till states are done: all of them, or any one if not all.
+    /// Returns the state which ended first, null if some were done already.
+    static JoinState *await(JoinState *const *states, size_t count, bool all);
+
+    /// Park till done, rethrow exception of the fiber
+    void join();
+
+    bool done = false;
+    std::exception_ptr exception;
+
+protected:
+    /// Resume join() callers with the exception in their context, wake combinators
+    void finish();
+
+private:
+    /// when_all/when_any parked on several states
+    struct Watcher {
+        size_t pending = 0;
+        JoinState *first = nullptr;
+        ContextQueue waiter;
+    };
+
+    ContextQueue joiners;
+    std::vector<Watcher *> watchers;
+};
+
+template <class R>
+class JoinResult : public JoinState {
+public:
+    template <class F>
+    void run(F &fiber) {
+        try {
+            value.emplace(fiber());
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        finish();
+    }
+
+    std::optional<R> value;
+};
+
+template <>
+class JoinResult<void> : public JoinState {
+public:
+    template <class F>
+    void run(F &fiber) {
+        try {
+            fiber();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        finish();
+    }
+};
+
+/// Handle of a fiber started by spawn(). Dropping it detaches the fiber.
+/// A cancelled fiber's get() throws Cancelled.
+template <class R>
+class JoinHandle {
+public:
+    JoinHandle() = default;
+
+    explicit JoinHandle(std::shared_ptr<JoinResult<R>> state) : state(std::move(state)) {
+    }
+
+    bool valid() const {
+        return state != nullptr;
+    }
+
+    bool done() const {
+        return state->done;
+    }
+
+    /// Park till the fiber ended, does not throw its exception
+    void wait() const {
+        JoinState *states[] = {state.get()};
+        JoinState::await(states, 1, true);
+    }
+
+    /// Park till the fiber ended, then its result or exception. Result is
+    /// moved out, so call once.
+    R get() {
+        state->join();
+        if constexpr (!std::is_void_v<R>) {
+            return std::move(*state->value);
+        }
+    }
+
+    JoinState *shared() const {
+        return state.get();
+    }
+
+private:
+    std::shared_ptr<JoinResult<R>> state;
+};
+
+/// Start fiber on the scheduler of current thread, its result is get() of the handle
+template <class F, class R = std::invoke_result_t<std::decay_t<F> &>>
+JoinHandle<R> spawn(F &&fiber, StackMode mode = StackMode::PRIVATE) {
+    auto state = std::make_shared<JoinResult<R>>();
+    FiberScheduler::resume(FiberScheduler::create_context_from_fiber(
+            [state, fiber = std::forward<F>(fiber)]() mutable {
+                state->run(fiber);
+            }, mode));
+    return JoinHandle<R>(std::move(state));
+}
+
+/// Park till all fibers ended, results in order. Exception of the first
+/// failed handle in order is rethrown after all ended.
+template <class R>
+std::conditional_t<std::is_void_v<R>, void, std::vector<R>> when_all(std::vector<JoinHandle<R>> &handles) {
+    std::vector<JoinState *> states;
+    states.reserve(handles.size());
+    for (auto &handle : handles) {
+        states.push_back(handle.shared());
+    }
+    JoinState::await(states.data(), states.size(), true);
+    if constexpr (std::is_void_v<R>) {
+        for (auto &handle : handles) {
+            handle.get();
+        }
+    } else {
+        std::vector<R> results;
+        results.reserve(handles.size());
+        for (auto &handle : handles) {
+            results.push_back(handle.get());
+        }
+        return results;
+    }
+}
+
+/// Park till any fiber ended, index of the first ended one (size of empty
+/// handles). The rest keep running: bind them to a CancelToken to stop them.
+template <class R>
+size_t when_any(const std::vector<JoinHandle<R>> &handles) {
+    std::vector<JoinState *> states;
+    states.reserve(handles.size());
+    for (auto &handle : handles) {
+        states.push_back(handle.shared());
+    }
+    auto *first = JoinState::await(states.data(), states.size(), false);
+    for (size_t i = 0; i != states.size(); ++i) {
+        if (first ? states[i] == first : states[i]->done) {
+            return i;
+        }
+    }
+    return states.size();
+}
@@ -0,0 +1,157 @@
+#include "profiling.hpp"
+
+#include <chrono>
+#include <iomanip>
+
+#include "scheduler.hpp"
+
+uint64_t Histogram::percentile(double q) const {
+    if (total == 0) {
+        return 0;
+    }
+    auto rank = static_cast<uint64_t>(q * (total - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i != BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank) {
+            return lower_bound(i);
+        }
+    }
+    return max_;
+}
+
+void Histogram::dump(std::ostream &out, double scale) const {
+    for (size_t i = 0; i != BUCKETS; ++i) {
+        if (counts[i]) {
+            out << lower_bound(i) * scale << ' ' << counts[i] << '\n';
+        }
+    }
+}
+
+void Profiler::attach(std::string tag) {
+    auto &context = FiberScheduler::current();
+    /// Pooled stacks keep pages of their earlier fibers resident: drop them,
+    /// the depth measured on exit is of this fiber only
+    if (context.stack.ptr && !context.shared_stack) {
+        context.stack.sp->discard_below(context.stack.ptr, __builtin_frame_address(0));
+    }
+    context.watch = std::make_shared<ProfilingWatch>(*this, std::move(tag));
+}
+
+Profiler::Profile Profiler::profile(const std::string &tag) const {
+    std::lock_guard lock(mutex);
+    auto it = profiles.find(tag);
+    return it == profiles.end() ? Profile() : it->second;
+}
+
+std::map<std::string, Profiler::Profile> Profiler::snapshot() const {
+    std::lock_guard lock(mutex);
+    return profiles;
+}
+
+void Profiler::report(std::ostream &out) const {
+    auto us = ns_per_cycle() / 1000;
+    for (auto &[tag, profile] : snapshot()) {
+        out << tag << ": fibers " << profile.fibers
+            << " slices " << profile.slices
+            << " cpu " << profile.cpu_cycles * us << "us"
+            << " parked " << profile.parked_cycles * us << "us"
+            << " runnable " << profile.runnable_cycles * us << "us"
+            << " stack " << profile.stack_high_water << '\n';
+        for (auto [name, histogram] : {std::pair{"slice", &profile.slice},
+                                       std::pair{"parked", &profile.parked},
+                                       std::pair{"runnable", &profile.runnable}}) {
+            out << "  " << name << " us: p50 " << histogram->percentile(0.5) * us
+                << " p99 " << histogram->percentile(0.99) * us
+                << " max " << histogram->max() * us << '\n';
+        }
+    }
+}
+
+double Profiler::ns_per_cycle() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const double value = []() {
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        auto cycles = now();
+        auto elapsed = Clock::duration();
+        while (elapsed < std::chrono::milliseconds(5)) {
+            elapsed = Clock::now() - start;
+        }
+        auto spent = now() - cycles;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / std::max<uint64_t>(spent, 1);
+    }();
+    return value;
+#else
+    return 1;
+#endif
+}
+
+ProfilingWatch::ProfilingWatch(Profiler &profiler, std::string tag)
+        : profiler(profiler), slice_start(Profiler::now()) {
+    std::lock_guard lock(profiler.mutex);
+    /// Map nodes keep their address, the watch holds it without lookups
+    profile = &profiler.profiles[std::move(tag)];
+}
+
+void ProfilingWatch::resumed(Context &) {
+    slice_start = Profiler::now();
+    if (suspended_at) {
+        auto runnable_from = std::max(scheduled_at, suspended_at);
+        gap_parked = runnable_from - suspended_at;
+        gap_runnable = slice_start - runnable_from;
+        gap = true;
+    }
+}
+
+void ProfilingWatch::scheduled(Context &) {
+    scheduled_at = Profiler::now();
+}
+
+void ProfilingWatch::operator()(Action &action, Context &context) {
+    auto now = Profiler::now();
+    samples[pending++] = {now - slice_start, gap_parked, gap_runnable, gap, waited};
+    suspended_at = now;
+    waited = action.action == Action::WAIT;
+    gap = false;
+    gap_parked = gap_runnable = 0;
+
+    /// Depth at the switch point, page granular depth since attach is taken on exit
+    if (context.shared_stack) {
+        stack_high_water = std::max(stack_high_water, context.saved_size);
+    } else if (context.stack.ptr) {
+        auto top = reinterpret_cast<intptr_t>(context.stack.top());
+        stack_high_water = std::max<size_t>(stack_high_water, top - context.esp);
+        if (action.action == Action::STOP) {
+            stack_high_water = std::max(stack_high_water, context.stack.sp->committed(context.stack.ptr));
+        }
+    }
+
+    if (action.action == Action::STOP || pending == FLUSH_SLICES) {
+        flush(action.action == Action::STOP);
+    }
+}
+
+void ProfilingWatch::flush(bool finished) {
+    std::lock_guard lock(profiler.mutex);
+    for (size_t i = 0; i != pending; ++i) {
+        auto &sample = samples[i];
+        ++profile->slices;
+        profile->cpu_cycles += sample.cpu;
+        profile->slice.record(sample.cpu);
+        if (!sample.resumed) {
+            continue;
+        }
+        profile->runnable_cycles += sample.runnable;
+        profile->runnable.record(sample.runnable);
+        if (sample.waited) {
+            profile->parked_cycles += sample.parked;
+            profile->parked.record(sample.parked);
+        }
+    }
+    pending = 0;
+    profile->stack_high_water = std::max(profile->stack_high_water, stack_high_water);
+    if (finished) {
+        ++profile->fibers;
+    }
+}
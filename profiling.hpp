@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "fibers.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// Log-linear histogram: 8 linear buckets per power of two, so any value is
+/// counted with at most 12.5% error over the whole uint64 range
+class Histogram {
+public:
+    enum {
+        SUB_BITS = 3,
+        SUB_BUCKETS = 1 << SUB_BITS,
+        BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS,
+    };
+
+    void record(uint64_t value) {
+        ++counts[index(value)];
+        ++total;
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i != BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    /// Lower bound of the bucket holding quantile q in [0, 1]
+    uint64_t percentile(double q) const;
+
+    /// Non-empty buckets as "lower_bound count" lines, values scaled by scale
+    void dump(std::ostream &out, double scale = 1) const;
+
+    static size_t index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        auto shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t lower_bound(size_t index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        auto shift = index / SUB_BUCKETS - 1;
+        return (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    }
+
+private:
+    std::array<uint64_t, BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t max_ = 0;
+};
+
+/// Per-tag aggregates of ProfilingWatch, safe to update from worker threads.
+/// Times are in TSC cycles, ns_per_cycle() converts them.
+class Profiler {
+public:
+    struct Profile {
+        /// Fibers finished with the tag
+        uint64_t fibers = 0;
+        uint64_t slices = 0;
+        uint64_t cpu_cycles = 0;
+        /// Waiting for io, timers or sync primitives
+        uint64_t parked_cycles = 0;
+        /// Queued in the scheduler after becoming runnable
+        uint64_t runnable_cycles = 0;
+        /// Deepest stack use of a fiber, bytes
+        size_t stack_high_water = 0;
+        Histogram slice;
+        Histogram parked;
+        Histogram runnable;
+    };
+
+    Profiler() = default;
+
+    Profiler(const Profiler &other) = delete;
+    void operator=(const Profiler &other) = delete;
+
+    /// Profile running fiber under tag from now on, profiler must outlive it.
+    /// Unused pages of its stack are given back, stack depth counts from here.
+    void attach(std::string tag);
+
+    /// Copy of aggregates so far, fibers flush every few slices and on exit
+    Profile profile(const std::string &tag) const;
+
+    std::map<std::string, Profile> snapshot() const;
+
+    /// Totals and slice/parked/runnable percentiles per tag
+    void report(std::ostream &out) const;
+
+    /// Cycle counter: TSC on x86, steady clock nanoseconds elsewhere
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    /// Calibrated against steady clock once
+    static double ns_per_cycle();
+
+private:
+    friend class ProfilingWatch;
+
+    mutable std::mutex mutex;
+    std::map<std::string, Profile> profiles;
+};
+
+/// Watch measuring a fiber: on-CPU time of every slice, time parked between
+/// slices vs time runnable in the queue, stack depth. Samples are buffered in
+/// the watch and merged into the tag under the profiler lock in batches.
+class ProfilingWatch : public Watch {
+public:
+    enum {
+        FLUSH_SLICES = 32,
+    };
+
+    ProfilingWatch(Profiler &profiler, std::string tag);
+
+    void resumed(Context &context) override;
+
+    void scheduled(Context &context) override;
+
+    void operator()(Action &action, Context &context) override;
+
+private:
+    struct Sample {
+        uint64_t cpu;
+        uint64_t parked;
+        uint64_t runnable;
+        /// Slice followed a gap: first slice after attach has none
+        bool resumed;
+        bool waited;
+    };
+
+    void flush(bool finished);
+
+    Profiler &profiler;
+    Profiler::Profile *profile;
+    /// Timestamps of the last slice start, suspension and scheduling
+    uint64_t slice_start;
+    uint64_t suspended_at = 0;
+    uint64_t scheduled_at = 0;
+    /// Gap before the running slice
+    uint64_t gap_parked = 0;
+    uint64_t gap_runnable = 0;
+    bool gap = false;
+    bool waited = false;
+    size_t stack_high_water = 0;
+    size_t pending = 0;
+    std::array<Sample, FLUSH_SLICES> samples;
+};
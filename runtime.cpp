@@ -1,20 +1,141 @@
 #include "runtime.hpp"
+#include "task.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <utility>
 
 StackPool stack_pool;
 
-Context::Context(Fiber fiber)
-        : fiber(std::make_unique<Fiber>(std::move(fiber))),
-          stack(stack_pool.alloc()),
-          esp(reinterpret_cast<intptr_t>(stack.ptr) + StackPool::STACK_SIZE) {
+void Context::save_stack(const void *from, size_t size) {
+    /// Right-size: shrink the buffer once the stack got much shallower
+    if (size > saved_capacity || size * 4 < saved_capacity) {
+        saved_stack = std::make_unique<char[]>(size);
+        saved_capacity = size;
+    }
+    std::memcpy(saved_stack.get(), from, size);
+    saved_size = size;
+}
+
+/// MSG_NOSIGNAL: report EPIPE as an error instead of killing the process
+static ssize_t send_nosignal(int fd, const char *data, size_t size) {
+    auto w = send(fd, data, size, MSG_NOSIGNAL);
+    if (w < 0 && errno == ENOTSOCK) {
+        w = ::write(fd, data, size);
+    }
+    return w;
+}
+
+namespace {
+    /// Freed contexts of this thread linked through next
+    struct ContextCache {
+        static constexpr size_t MAX_SIZE = 4096;
+
+        Context *head = nullptr;
+        size_t size = 0;
+
+        ~ContextCache() {
+            while (head) {
+                delete std::exchange(head, head->next);
+            }
+            size = 0;
+        }
+    };
+
+    thread_local ContextCache context_cache;
+}
+
+FiberLocals::Destroy FiberLocals::destroyers[FiberLocals::MAX_SLOTS];
+
+size_t FiberLocals::allocate(Destroy destroy) {
+    static std::atomic<size_t> next{0};
+    auto slot = next.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= MAX_SLOTS) {
+        throw std::length_error("Too many FiberLocal slots");
+    }
+    destroyers[slot] = destroy;
+    return slot;
 }
 
-EpollScheduler *current_scheduler = nullptr;
+void FiberLocals::reset(size_t slot) {
+    auto mask = uint32_t(1) << slot;
+    if (used & mask) {
+        used &= ~mask;
+        destroyers[slot](values[slot], heap & mask);
+        heap &= ~mask;
+    }
+}
+
+void FiberLocals::clear() {
+    while (used) {
+        reset(31 - __builtin_clz(used));
+    }
+    arena_used = 0;
+}
 
-void schedule(Fiber fiber) {
+void *FiberLocals::take(size_t size, size_t align) {
+    if (!arena) {
+        arena = std::make_unique<char[]>(ARENA_SIZE);
+    }
+    auto base = reinterpret_cast<uintptr_t>(arena.get());
+    auto offset = (base + arena_used + align - 1) / align * align - base;
+    if (offset + size > ARENA_SIZE) {
+        return nullptr;
+    }
+    arena_used = offset + size;
+    return arena.get() + offset;
+}
+
+ContextPtr make_context() {
+    auto &cache = context_cache;
+    if (!cache.head) {
+        return ContextPtr(new Context);
+    }
+    --cache.size;
+    auto *context = std::exchange(cache.head, cache.head->next);
+    context->next = nullptr;
+    return ContextPtr(context);
+}
+
+void ContextDeleter::operator()(Context *context) const {
+    /// Release stack, closure, watch and saved stack now, keep the memory
+    CancelToken::detach(*context);
+    if (context->frame) {
+        /// Task dropped while parked or queued, e.g. with its scheduler
+        Async::destroy_frame(std::exchange(context->frame, nullptr));
+    }
+    *context = Context();
+    auto &cache = context_cache;
+    if (cache.size == ContextCache::MAX_SIZE) {
+        delete context;
+        return;
+    }
+    ++cache.size;
+    context->next = std::exchange(cache.head, context);
+}
+
+thread_local FiberScheduler *current_scheduler = nullptr;
+thread_local IoScheduler *current_io = nullptr;
+
+/// A fiber may be resumed by another worker thread, so code running on a fiber
+/// stack must reload the thread local after every switch instead of caching it.
+__attribute__((noinline, noipa)) static FiberScheduler *this_thread_scheduler() {
+    return current_scheduler;
+}
+
+void schedule(ContextPtr context) {
     if (!current_scheduler) {
         throw std::runtime_error("Global scheduler is empty");
     }
-    current_scheduler->schedule(std::move(fiber));
+    current_scheduler->schedule(std::move(context));
 }
 
 void yield() {
@@ -32,117 +153,1492 @@ void create_current_fiber_watch(Args... args) {
     current_scheduler->create_current_fiber_watch<Watch>(args...);
 }
 
-void trampoline(Fiber *fiber) {
-    /// process exceptions with std::current_exception()
-    (*fiber)();
+void trampoline(Closure::Entry *entry) {
+    try {
+        entry->ops(Closure::Op::RUN, entry->object, nullptr);
+    } catch (const Cancelled &) {
+    } catch (...) {
+        this_thread_scheduler()->sched_context->exception = std::current_exception();
+    }
+    entry->ops(Closure::Op::DESTROY, entry->object, nullptr);
+    /// Fiber locals die on the fiber, they may still use Async:: calls
+    this_thread_scheduler()->sched_context->locals.clear();
 
-    current_scheduler->sched_context.switch_context(Action{Action::STOP});
+    this_thread_scheduler()->sched_context->switch_context(Action{Action::STOP});
     __builtin_unreachable();
 }
 
+/// fibers_switch_context(esp slot, eip slot, action) saves callee-saved registers,
+/// MXCSR and x87 control word on the current stack, swaps stack pointer and resume
+/// address with the slots and returns the action pointer passed by the other side.
+/// Caller-saved registers are dead across a call by ABI, so they are not spilled.
+///
+/// fibers_start is the first resume address of a fresh context: the stack holds
+/// closure entry pointer and entry function (see bind_stack).
+#if defined(__x86_64__)
+asm(R"(
+    .text
+    .p2align 4
+    .type fibers_switch_context, @function
+fibers_switch_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, %rax
+    movq (%rdi), %rsp
+    movq %rax, (%rdi)
+    movq (%rsi), %rcx
+    leaq 1f(%rip), %rax
+    movq %rax, (%rsi)
+    movq %rdx, %rax
+    jmpq *%rcx
+1:
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    retq
+    .size fibers_switch_context, .-fibers_switch_context
+
+    .p2align 4
+    .type fibers_start, @function
+fibers_start:
+    movq (%rsp), %rdi
+    callq *8(%rsp)
+    ud2
+    .size fibers_start, .-fibers_start
+)");
+#elif defined(__i386__)
+asm(R"(
+    .text
+    .p2align 4
+    .type fibers_switch_context, @function
+fibers_switch_context:
+    movl 4(%esp), %ecx
+    movl 8(%esp), %edx
+    movl 12(%esp), %eax
+    pushl %ebp
+    pushl %ebx
+    pushl %esi
+    pushl %edi
+    subl $8, %esp
+    stmxcsr (%esp)
+    fnstcw 4(%esp)
+    movl %esp, %esi
+    movl (%ecx), %esp
+    movl %esi, (%ecx)
+    movl (%edx), %esi
+    call 0f
+0:
+    popl %edi
+    addl $(1f - 0b), %edi
+    movl %edi, (%edx)
+    jmpl *%esi
+1:
+    ldmxcsr (%esp)
+    fldcw 4(%esp)
+    addl $8, %esp
+    popl %edi
+    popl %esi
+    popl %ebx
+    popl %ebp
+    retl
+    .size fibers_switch_context, .-fibers_switch_context
+
+    .p2align 4
+    .type fibers_start, @function
+fibers_start:
+    movl 4(%esp), %eax
+    calll *%eax
+    ud2
+    .size fibers_start, .-fibers_start
+)");
+#else
+#error "Context switch is implemented only for x86-64 and i386"
+#endif
+
+extern "C" Action *fibers_switch_context(intptr_t *espp, intptr_t *eipp, Action *action);
+extern "C" void fibers_start();
+
 Action Context::switch_context(Action action) {
-    auto *eipp = &eip;
-    auto *espp = &esp;
-    asm volatile(""  /// save ebp
-                 ""  /// switch esp
-                 ""  /// switch eip with ret_label
-                 /// BEFORE (B) GOING BACK
-                 "ret_label:"
-                 /// AFTER (A)
-                 ""  /// load ebp
-                 : "+S"(espp), "+D"(eipp)  /// throw action
-                 ::"eax", "ebx", "ecx", "edx", "memory", "cc");
-    return action;
-}
-
-Context FiberScheduler::create_context_from_fiber(Fiber fiber) {
-    Context context(std::move(fiber));
-
-    /// stack
+    return *fibers_switch_context(&esp, &eip, &action);
+}
+
+void *FiberScheduler::bind_stack(Context &context, char *top, size_t size, size_t align, Closure::Ops ops) {
+    if (!top) {
+        context.stack = stack_pool.alloc();
+        top = static_cast<char *>(context.stack.top());
+    }
+
+    /// stack top: entry, callable, entry frame
+    auto *entry = reinterpret_cast<Closure::Entry *>(top) - 1;
+    auto object = (reinterpret_cast<uintptr_t>(entry) - size) & ~(uintptr_t(align) - 1);
+    *entry = Closure::Entry{ops, reinterpret_cast<void *>(object)};
+
+    /// stack: keep 16 byte alignment at the entry call
+    auto *frame = reinterpret_cast<intptr_t *>(object & ~uintptr_t(15)) - 16 / sizeof(intptr_t);
     /// function
+    frame[0] = reinterpret_cast<intptr_t>(entry);
+    frame[1] = reinterpret_cast<intptr_t>(&trampoline);
 
-    return context;
+    context.esp = reinterpret_cast<intptr_t>(frame);
+    context.eip = reinterpret_cast<intptr_t>(&fibers_start);
+    return entry->object;
+}
+
+Context &FiberScheduler::current() {
+    auto *sched = this_thread_scheduler();
+    if (!sched) {
+        throw std::runtime_error("Global scheduler is empty");
+    }
+    if (!sched->sched_context) {
+        throw std::runtime_error("No running fiber");
+    }
+    return *sched->sched_context;
+}
+
+char *FiberScheduler::shared_stack_top() {
+    if (!shared_stack.ptr) {
+        shared_stack = stack_pool.alloc();
+    }
+    return static_cast<char *>(shared_stack.top());
+}
+
+YieldData FiberScheduler::suspend(Action action) {
+    CancelToken::check();
+    action = this_thread_scheduler()->sched_context->switch_context(action);
+    if (action.action == Action::THROW) {
+        auto exception = std::exchange(this_thread_scheduler()->sched_context->exception, nullptr);
+        std::rethrow_exception(exception);
+    }
+    return action.user_data;
 }
 
 YieldData FiberScheduler::yield(YieldData data) {
-    /// current_scheduler->sched_context
-    /// If THROW -> throw current_scheduler->sched_context.exception
+    return suspend(Action{Action::SCHED, data});
+}
+
+YieldData FiberScheduler::wait(Await callback, YieldData data) {
+    Wait wait{callback, data};
+    YieldData user_data;
+    user_data.ptr = &wait;
+    return suspend(Action{Action::WAIT, user_data});
+}
+
+void FiberScheduler::park(ContextQueue &queue) {
+    YieldData data;
+    data.ptr = &queue;
+    wait([](ContextPtr context, YieldData data) {
+        context->unpark = [](Context &context, void *owner) {
+            auto parked = static_cast<ContextQueue *>(owner)->remove(&context);
+            parked->exception = std::make_exception_ptr(Cancelled());
+            resume(std::move(parked));
+        };
+        context->unpark_owner = data.ptr;
+        static_cast<ContextQueue *>(data.ptr)->push(std::move(context));
+    }, data);
+}
+
+JoinState *JoinState::await(JoinState *const *states, size_t count, bool all) {
+    size_t running = 0;
+    for (size_t i = 0; i != count; ++i) {
+        running += !states[i]->done;
+    }
+    if (!running || (!all && running != count)) {
+        return nullptr;
+    }
+    /// Finishing fibers write the watcher while the caller is parked, so it
+    /// must not live on the caller's stack: a SHARED one is swapped out
+    auto watcher = std::make_unique<Watcher>();
+    watcher->pending = all ? running : 1;
+    for (size_t i = 0; i != count; ++i) {
+        if (!states[i]->done) {
+            states[i]->watchers.push_back(watcher.get());
+        }
+    }
+    /// Also when parking throws Cancelled: watcher dies with this frame
+    struct Unregister {
+        JoinState *const *states;
+        size_t count;
+        Watcher *watcher;
+
+        ~Unregister() {
+            for (size_t i = 0; i != count; ++i) {
+                auto &watchers = states[i]->watchers;
+                auto it = std::find(watchers.begin(), watchers.end(), watcher);
+                if (it != watchers.end()) {
+                    *it = watchers.back();
+                    watchers.pop_back();
+                }
+            }
+        }
+    } unregister{states, count, watcher.get()};
+    FiberScheduler::park(watcher->waiter);
+    return watcher->first;
+}
+
+void JoinState::join() {
+    if (!done) {
+        /// Resumed with the exception, if any, thrown from park
+        FiberScheduler::park(joiners);
+        return;
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+void JoinState::finish() {
+    done = true;
+    while (!joiners.empty()) {
+        auto context = joiners.pop();
+        context->exception = exception;
+        FiberScheduler::resume(std::move(context));
+    }
+    for (auto *watcher : watchers) {
+        if (!watcher->first) {
+            watcher->first = this;
+        }
+        /// Waiter may be gone from the queue already, unwinding Cancelled
+        if (watcher->pending && --watcher->pending == 0 && !watcher->waiter.empty()) {
+            FiberScheduler::resume(watcher->waiter.pop());
+        }
+    }
+    watchers.clear();
+}
+
+void FiberScheduler::wait_frame(void *frame, Await callback, YieldData data) {
+    auto *sched = this_thread_scheduler();
+    CancelToken::check();
+    sched->sched_context->frame = frame;
+    callback(std::move(sched->sched_context), data);
+}
+
+YieldData FiberScheduler::frame_result() {
+    auto &context = *this_thread_scheduler()->sched_context;
+    if (context.exception) {
+        std::rethrow_exception(std::exchange(context.exception, nullptr));
+    }
+    return context.yield_data;
+}
+
+void FiberScheduler::run_frame(ContextPtr context) {
+    [[maybe_unused]] auto *traced = context.get();
+    sched_context = std::move(context);
+    FIBERS_TRACE(SWITCH_IN, traced, 0);
+    FiberLocals::current = &sched_context->locals;
+    std::coroutine_handle<>::from_address(sched_context->frame).resume();
+    FiberLocals::current = nullptr;
+    if (!sched_context) {
+        /// Awaiter handed the context to a backend or a queue
+        FIBERS_TRACE(SWITCH_OUT, traced, Action::WAIT);
+        return;
+    }
+    /// Root task ended and freed its frame
+    FIBERS_TRACE(SWITCH_OUT, traced, Action::STOP);
+    sched_context->frame = nullptr;
+    sched_context->locals.clear();
+    auto exception = std::exchange(sched_context->exception, nullptr);
+    sched_context = {};
+    if (exception) {
+        try {
+            std::rethrow_exception(exception);
+        } catch (const Cancelled &) {
+        }
+    }
+}
+
+void CancelToken::cancel() const {
+    if (state->cancelled) {
+        return;
+    }
+    state->cancelled = true;
+    /// Hooks reschedule contexts, which stay bound
+    for (size_t i = 0; i != state->fibers.size(); ++i) {
+        auto &context = *state->fibers[i];
+        if (context.unpark && !context.cancel_shield) {
+            std::exchange(context.unpark, nullptr)(context, context.unpark_owner);
+        }
+    }
+}
+
+void CancelToken::attach(Context &context) const {
+    detach(context);
+    context.cancel = state;
+    context.cancel_index = state->fibers.size();
+    state->fibers.push_back(&context);
+}
+
+void CancelToken::detach(Context &context) {
+    auto state = std::move(context.cancel);
+    if (!state) {
+        return;
+    }
+    auto &fibers = state->fibers;
+    fibers[context.cancel_index] = fibers.back();
+    fibers[context.cancel_index]->cancel_index = context.cancel_index;
+    fibers.pop_back();
+}
+
+void CancelToken::check() {
+    auto &context = FiberScheduler::current();
+    if (context.cancel && context.cancel->cancelled && !context.cancel_shield) {
+        throw Cancelled();
+    }
+}
+
+Nursery::~Nursery() {
+    if (!state->running) {
+        return;
+    }
+    state->token.cancel();
+    CancelShield shield;
+    while (state->running) {
+        FiberScheduler::park(state->joiners);
+    }
+}
+
+void Nursery::join() {
+    while (state->running) {
+        FiberScheduler::park(state->joiners);
+    }
+    if (state->error) {
+        std::rethrow_exception(std::exchange(state->error, nullptr));
+    }
+}
+
+void Nursery::State::failed(std::exception_ptr exception) {
+    if (!error) {
+        error = std::move(exception);
+    }
+    token.cancel();
+}
+
+void Nursery::State::finished() {
+    if (--running == 0) {
+        while (!joiners.empty()) {
+            FiberScheduler::resume(joiners.pop());
+        }
+    }
+}
+
+void FiberScheduler::resume(ContextPtr context) {
+    auto *sched = this_thread_scheduler();
+    if (!sched) {
+        throw std::runtime_error("Global scheduler is empty");
+    }
+    sched->schedule(std::move(context));
+}
+
+namespace {
+    constexpr uint32_t PRIORITY_WEIGHTS[FiberScheduler::PRIORITIES] = {16, 4, 1};
+
+    bool later_deadline(const Context *a, const Context *b) {
+        return a->deadline > b->deadline;
+    }
+}
+
+FiberScheduler::~FiberScheduler() {
+    assert(empty());
+    for (auto *context : deadlines) {
+        ContextDeleter()(context);
+    }
+}
+
+void FiberScheduler::schedule(ContextPtr context) {
+    FIBERS_TRACE(WAKE, context.get(), 0);
+    context->unpark = nullptr;
+    if (context->watch) {
+        context->watch->scheduled(*context);
+    }
+    context->enqueued = dispatches;
+    ++queued;
+    if (context->deadline != Deadline::max()) {
+        deadlines.push_back(context.release());
+        std::push_heap(deadlines.begin(), deadlines.end(), later_deadline);
+        return;
+    }
+    queues[static_cast<size_t>(context->priority)].push(std::move(context));
+}
+
+ContextPtr FiberScheduler::pick() {
+    ++dispatches;
+    /// Only the default class is queued: plain FIFO
+    auto &normal = queues[static_cast<size_t>(Priority::NORMAL)];
+    if (normal.size() == queued--) {
+        return normal.pop();
+    }
+    for (size_t priority = PRIORITIES; priority-- > 1;) {
+        auto &queue = queues[priority];
+        if (!queue.empty() && dispatches - queue.front().enqueued > AGING_DISPATCHES) {
+            return queue.pop();
+        }
+    }
+    if (!deadlines.empty()) {
+        std::pop_heap(deadlines.begin(), deadlines.end(), later_deadline);
+        ContextPtr context(deadlines.back());
+        deadlines.pop_back();
+        return context;
+    }
+    while (true) {
+        for (size_t priority = 0; priority != PRIORITIES; ++priority) {
+            if (credits[priority] && !queues[priority].empty()) {
+                --credits[priority];
+                return queues[priority].pop();
+            }
+        }
+        std::copy(std::begin(PRIORITY_WEIGHTS), std::end(PRIORITY_WEIGHTS), credits);
+    }
 }
 
 void FiberScheduler::run_one() {
-    sched_context = std::move(queue.front());
-    queue.pop();
+    run_context(pick());
+}
+
+void FiberScheduler::run_context(ContextPtr context) {
+    if (context->frame) {
+        run_frame(std::move(context));
+        return;
+    }
+    sched_context = std::move(context);
+
+    char *top = nullptr;
+    if (sched_context->shared_stack) {
+        if (sched_context->shared_owner && sched_context->shared_owner != this) {
+            throw std::logic_error("Shared stack fiber resumed by another scheduler");
+        }
+        sched_context->shared_owner = this;
+        top = shared_stack_top();
+    }
+
+    if (!sched_context->esp) {
+        /// First run: queued fibers hold no stack
+        auto &closure = sched_context->closure;
+        closure.place(bind_stack(*sched_context, top, closure.size(), closure.align(), closure.ops()));
+    } else if (top) {
+        sched_context->esp = reinterpret_cast<intptr_t>(top - sched_context->saved_size);
+        std::memcpy(top - sched_context->saved_size, sched_context->saved_stack.get(), sched_context->saved_size);
+    }
+
+    if (sched_context->watch) {
+        sched_context->watch->resumed(*sched_context);
+    }
+
+    FIBERS_TRACE(SWITCH_IN, sched_context.get(), 0);
+    FiberLocals::current = &sched_context->locals;
+    auto action = sched_context->switch_context(
+            Action{sched_context->exception ? Action::THROW : Action::START, sched_context->yield_data});
+    FiberLocals::current = nullptr;
+    FIBERS_TRACE(SWITCH_OUT, sched_context.get(), action.action);
 
-    /// run with START or THROW if exception
-    /// except if exception with std::rethrow_exception
-    /// watch if watch
-    /// schedule again if SCHE
+    if (top && action.action != Action::STOP) {
+        auto *esp = reinterpret_cast<char *>(sched_context->esp);
+        sched_context->save_stack(esp, top - esp);
+    }
+
+    if (sched_context->watch) {
+        (*sched_context->watch)(action, *sched_context);
+    }
+
+    switch (action.action) {
+        case Action::STOP: {
+            auto exception = std::exchange(sched_context->exception, nullptr);
+            sched_context = {};
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+            break;
+        }
+        case Action::SCHED:
+            schedule(std::move(sched_context));
+            break;
+        case Action::WAIT: {
+            auto *wait = static_cast<Wait *>(action.user_data.ptr);
+            wait->callback(std::move(sched_context), wait->data);
+            break;
+        }
+        default:
+            throw std::logic_error("Unexpected action from fiber");
+    }
+}
+
+IoScheduler &IoScheduler::running() {
+    if (!current_io) {
+        throw std::runtime_error("Io scheduler is empty");
+    }
+    return *current_io;
 }
 
-void scheduler_run(EpollScheduler &sched) {
+void scheduler_run(IoScheduler &sched) {
     if (current_scheduler) {
         throw std::runtime_error("Global scheduler is not empty");
     }
-    current_scheduler = &sched;
-    current_scheduler->run();
-    current_scheduler = nullptr;
+    current_scheduler = current_io = &sched;
+    try {
+        sched.run();
+    } catch (...) {
+        current_scheduler = current_io = nullptr;
+        throw;
+    }
+    current_scheduler = current_io = nullptr;
+}
+
+
+void IoScheduler::await_sleep(ContextPtr context, YieldData data) {
+    Sleeper *sleeper;
+    if (!free_sleepers.empty()) {
+        sleeper = free_sleepers.back();
+        free_sleepers.pop_back();
+    } else {
+        sleeper = &sleepers.emplace_back();
+        sleeper->expire = &IoScheduler::wake;
+    }
+    sleeper->context = std::move(context);
+    sleeper->scheduler = this;
+    sleeper->context->unpark = &IoScheduler::cancel;
+    sleeper->context->unpark_owner = sleeper;
+    timers.arm(*sleeper, *static_cast<TimingWheel::Clock::time_point *>(data.ptr));
+}
+
+void IoScheduler::wake(TimingWheel::Timer &timer, void *owner) {
+    auto &sleeper = static_cast<Sleeper &>(timer);
+    auto *self = static_cast<IoScheduler *>(owner);
+    self->schedule(std::move(sleeper.context));
+    self->free_sleepers.push_back(&sleeper);
+}
+
+void IoScheduler::cancel(Context &, void *owner) {
+    auto &sleeper = *static_cast<Sleeper *>(owner);
+    auto *self = sleeper.scheduler;
+    self->timers.disarm(sleeper);
+    sleeper.context->exception = std::make_exception_ptr(Cancelled());
+    self->schedule(std::move(sleeper.context));
+    self->free_sleepers.push_back(&sleeper);
+}
+
+EpollScheduler::Node *EpollScheduler::make_node(ContextPtr context, int fd, YieldData data, Callback callback,
+                                                TimingWheel::Clock::time_point deadline) {
+    Node *node;
+    if (!free_nodes.empty()) {
+        node = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        node = &nodes.emplace_back();
+    }
+    node->context = std::move(context);
+    node->fd = fd;
+    node->data = data;
+    node->callback = callback;
+    node->deadline = deadline;
+    node->scheduler = this;
+    return node;
 }
 
+void EpollScheduler::finish(Node *node) {
+    schedule(std::move(node->context));
+    free_nodes.push_back(node);
+}
 
-void EpollScheduler::await_read(Context context, YieldData data) {
-    /// Subscribe epoll for read
+EpollScheduler::FdState &EpollScheduler::fd_state(int fd) {
+    if (fd < 0) {
+        throw std::system_error(EBADF, std::generic_category(), "epoll");
+    }
+    if (static_cast<size_t>(fd) >= fds.size()) {
+        fds.resize(std::max(static_cast<size_t>(fd) + 1, fds.size() * 2));
+    }
+    return fds[fd];
 }
 
-void EpollScheduler::do_read(Node node) {
-    /// Do read, schedule fiber
+bool EpollScheduler::register_fd(int fd, FdState &state) {
+    if (state.registered) {
+        return true;
+    }
+    /// Edge triggered readiness needs syscalls to stop at EAGAIN
+    auto flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 && errno != EEXIST) {
+        return false;
+    }
+    state.registered = true;
+    return true;
 }
 
-void EpollScheduler::await_write(Context context, YieldData data) {
-    /// Subscribe epoll for write
+bool EpollScheduler::rejected(Node *node, Node *FdState::*slot) {
+    std::exception_ptr error;
+    if (node->fd < 0) {
+        error = std::make_exception_ptr(std::system_error(EBADF, std::generic_category(), "epoll"));
+    } else if (fd_state(node->fd).*slot) {
+        error = std::make_exception_ptr(std::runtime_error("Fd is already awaited by another fiber"));
+    } else {
+        return false;
+    }
+    node->context->exception = std::move(error);
+    finish(node);
+    return true;
 }
 
-void EpollScheduler::do_write(Node node) {
-    /// Do write, schedule fiber
+void EpollScheduler::park(Node *node, Node *FdState::*slot) {
+    if (rejected(node, slot)) {
+        return;
+    }
+    auto &state = fds[node->fd];
+    if (!register_fd(node->fd, state)) {
+        do_error(node);
+        return;
+    }
+    state.*slot = node;
+    ++parked;
+    node->context->unpark = &EpollScheduler::cancel;
+    node->context->unpark_owner = node;
+    if (node->deadline != TimingWheel::Clock::time_point::max()) {
+        timers.arm(*node, node->deadline);
+    }
 }
 
-void EpollScheduler::await_accept(Context context, YieldData data) {
-    /// Subscribe epoll for accept
+EpollScheduler::Node *EpollScheduler::unpark(int fd, Node *FdState::*slot) {
+    auto *node = std::exchange(fds[fd].*slot, nullptr);
+    timers.disarm(*node);
+    --parked;
+    return node;
 }
 
-void EpollScheduler::do_accept(Node node) {
-    /// Do accept, schedule fiber
+void EpollScheduler::forget(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= fds.size()) {
+        return;
+    }
+    if (fds[fd].in) {
+        do_error(unpark(fd, &FdState::in));
+    }
+    if (fds[fd].out) {
+        do_error(unpark(fd, &FdState::out));
+    }
+    /// Closing fd removes it from epoll
+    fds[fd] = FdState{};
+}
+
+bool EpollScheduler::ready_hint(int fd, uint32_t events) {
+    if (fd < 0 || static_cast<size_t>(fd) >= fds.size() || !fds[fd].registered) {
+        return false;
+    }
+    return events & EPOLLOUT ? fds[fd].writable : fds[fd].readable;
+}
+
+void EpollScheduler::clear_hint(int fd, uint32_t events) {
+    (events & EPOLLOUT ? fds[fd].writable : fds[fd].readable) = false;
 }
 
-void EpollScheduler::do_error(Node node) {
-    /// Throw runtime_error in fiber
+void EpollScheduler::await_read(ContextPtr context, YieldData data) {
+    auto *read_data = static_cast<ReadData *>(data.ptr);
+    auto *node = make_node(std::move(context), read_data->fd, data, &EpollScheduler::do_read, read_data->deadline);
+    if (ready_hint(node->fd, EPOLLIN)) {
+        do_read(node);
+    } else {
+        park(node, &FdState::in);
+    }
+}
+
+void EpollScheduler::do_read(Node *node) {
+    auto *read_data = static_cast<ReadData *>(node->data.ptr);
+    auto r = ::read(read_data->fd, read_data->data, read_data->size);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fds[node->fd].readable = false;
+        park(node, &FdState::in);
+        return;
+    }
+    if (r < 0) {
+        node->context->exception = std::make_exception_ptr(
+                std::system_error(errno, std::generic_category(), "read"));
+    } else {
+        node->context->yield_data.ss = r;
+    }
+    finish(node);
+}
+
+void EpollScheduler::await_write(ContextPtr context, YieldData data) {
+    auto *write_data = static_cast<WriteData *>(data.ptr);
+    auto *node = make_node(std::move(context), write_data->fd, data, &EpollScheduler::do_write, write_data->deadline);
+    if (ready_hint(node->fd, EPOLLOUT)) {
+        do_write(node);
+    } else {
+        park(node, &FdState::out);
+    }
+}
+
+void EpollScheduler::do_write(Node *node) {
+    auto *write_data = static_cast<WriteData *>(node->data.ptr);
+    auto w = send_nosignal(write_data->fd, write_data->data, write_data->size);
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fds[node->fd].writable = false;
+        park(node, &FdState::out);
+        return;
+    }
+    if (w < 0) {
+        node->context->exception = std::make_exception_ptr(
+                std::system_error(errno, std::generic_category(), "write"));
+    } else {
+        node->context->yield_data.ss = w;
+    }
+    finish(node);
+}
+
+void EpollScheduler::await_accept(ContextPtr context, YieldData data) {
+    auto *accept_data = static_cast<AcceptData *>(data.ptr);
+    auto *node = make_node(std::move(context), accept_data->fd, data, &EpollScheduler::do_accept, accept_data->deadline);
+    if (ready_hint(node->fd, EPOLLIN)) {
+        do_accept(node);
+    } else {
+        park(node, &FdState::in);
+    }
+}
+
+void EpollScheduler::do_accept(Node *node) {
+    auto *accept_data = static_cast<AcceptData *>(node->data.ptr);
+    auto fd = ::accept(accept_data->fd, accept_data->addr, accept_data->addrlen);
+    if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fds[node->fd].readable = false;
+        park(node, &FdState::in);
+        return;
+    }
+    if (fd < 0) {
+        node->context->exception = std::make_exception_ptr(
+                std::system_error(errno, std::generic_category(), "accept"));
+    } else {
+        node->context->yield_data.i = fd;
+    }
+    finish(node);
+}
+
+void EpollScheduler::await_poll(ContextPtr context, YieldData data) {
+    auto *poll_data = static_cast<PollData *>(data.ptr);
+    auto *node = make_node(std::move(context), poll_data->fd, data, &EpollScheduler::do_ready, poll_data->deadline);
+    auto slot = poll_data->events & EPOLLOUT ? &FdState::out : &FdState::in;
+    if (rejected(node, slot)) {
+        return;
+    }
+    auto &state = fds[node->fd];
+    auto was_registered = state.registered;
+    /// Cached edge may be older than the caller's EAGAIN: drop it and re-arm,
+    /// EPOLL_CTL_MOD reports current readiness as a new edge
+    (poll_data->events & EPOLLOUT ? state.writable : state.readable) = false;
+    park(node, slot);
+    if (was_registered && fds[node->fd].*slot == node) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.fd = node->fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, node->fd, &event) < 0) {
+            do_error(unpark(node->fd, slot));
+        }
+    }
+}
+
+void EpollScheduler::do_ready(Node *node) {
+    finish(node);
+}
+
+void EpollScheduler::do_error(Node *node) {
+    node->context->exception = std::make_exception_ptr(std::runtime_error("Error on fd " + std::to_string(node->fd)));
+    finish(node);
+}
+
+void EpollScheduler::do_timeout(Node *node) {
+    node->context->exception = std::make_exception_ptr(TimeoutError("Timeout on fd " + std::to_string(node->fd)));
+    finish(node);
+}
+
+void EpollScheduler::expire(TimingWheel::Timer &timer, void *owner) {
+    auto &node = static_cast<Node &>(timer);
+    auto *self = static_cast<EpollScheduler *>(static_cast<IoScheduler *>(owner));
+    auto slot = self->fds[node.fd].in == &node ? &FdState::in : &FdState::out;
+    self->do_timeout(self->unpark(node.fd, slot));
+}
+
+void EpollScheduler::cancel(Context &, void *owner) {
+    auto &node = *static_cast<Node *>(owner);
+    auto *self = node.scheduler;
+    auto slot = self->fds[node.fd].in == &node ? &FdState::in : &FdState::out;
+    self->unpark(node.fd, slot);
+    node.context->exception = std::make_exception_ptr(Cancelled());
+    self->finish(&node);
+}
+
+void EpollScheduler::accepted(int fd) {
+    /// Number may be left from an fd closed without Async::close
+    forget(fd);
+    if (options.socket_busy_poll > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options.socket_busy_poll, sizeof(options.socket_busy_poll));
+    }
+}
+
+int EpollScheduler::harvest(int timeout) {
+    ++(timeout ? stats_.waits : stats_.polls);
+    auto n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw std::system_error(errno, std::generic_category(), "epoll_wait");
+    }
+    stats_.events += n;
+    stats_.max_batch = std::max(stats_.max_batch, static_cast<size_t>(n));
+    for (int i = 0; i != n; ++i) {
+        auto fd = events[i].data.fd;
+        auto mask = events[i].events;
+        if (static_cast<size_t>(fd) >= fds.size() || !fds[fd].registered) {
+            continue;
+        }
+        auto &state = fds[fd];
+        state.readable |= (mask & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+        state.writable |= (mask & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+        /// If error do_error, readiness waiters learn it from their own syscall
+        /// (a failed connect reports through SO_ERROR)
+        if (mask & EPOLLERR) {
+            for (auto slot : {&FdState::in, &FdState::out}) {
+                if (!(fds[fd].*slot)) {
+                    continue;
+                }
+                auto *node = unpark(fd, slot);
+                if (node->callback == &EpollScheduler::do_ready) {
+                    finish(node);
+                } else {
+                    do_error(node);
+                }
+            }
+            continue;
+        }
+        /// Else if in or out process it, callbacks park again on EAGAIN
+        if (state.readable && state.in) {
+            auto *node = unpark(fd, &FdState::in);
+            (this->*node->callback)(node);
+        }
+        if (fds[fd].writable && fds[fd].out) {
+            auto *node = unpark(fd, &FdState::out);
+            (this->*node->callback)(node);
+        }
+    }
+    return n;
+}
+
+bool EpollScheduler::busy_poll() {
+    using namespace std::chrono;
+    if (spin_window.count() == 0 || !parked) {
+        return false;
+    }
+    auto start = steady_clock::now();
+    auto until = start + spin_window;
+    if (!timers.empty()) {
+        until = std::min(until, start + milliseconds(wait_timeout()));
+    }
+    do {
+        if (harvest(0) > 0 || !empty()) {
+            /// Caught an event: widen the window back to its limit
+            spin_window = std::min(options.busy_poll, std::max(spin_window * 2, microseconds(1)));
+            return true;
+        }
+    } while (steady_clock::now() < until);
+    spin_window /= 2;
+    return false;
 }
 
 void EpollScheduler::run() {
     while (true) {
-        /// Process all fibers
-        while (!empty()) {
-            run_one();
-        }
-        /// If no fd to wait break
-        if (wait_list.empty()) {
+        /// Process ready fibers. Io on a ready fd completes without parking,
+        /// so fibers may stay runnable: harvest edges between batches anyway
+        run_ready();
+        expire_timers();
+        /// If no fiber, no fd and no timer to wait break
+        if (empty() && !parked && timers.empty()) {
             break;
         }
-        /// Wait any fd
-        /// If error do_error
-        /// Else if in or out process it
+        if (!empty()) {
+            harvest(0);
+            continue;
+        }
+        if (busy_poll()) {
+            continue;
+        }
+        /// Wait any fd or the nearest timer
+        if (harvest(wait_timeout()) > 0 && options.busy_poll.count() != 0) {
+            /// Traffic again after idle spins: give spinning another chance
+            spin_window = std::max(spin_window, options.busy_poll / 16);
+        }
+    }
+}
+
+namespace {
+    /// Failed rounds of stealing before an idle worker sleeps
+    constexpr uint32_t IDLE_ROUNDS = 64;
+}
+
+WorkStealingScheduler::Worker::Worker(WorkStealingScheduler &owner, size_t index)
+        : owner(owner), index(index), rng(index + 1) {
+}
+
+void WorkStealingScheduler::Worker::schedule(ContextPtr context) {
+    FIBERS_TRACE(WAKE, context.get(), 0);
+    context->unpark = nullptr;
+    if (context->watch) {
+        context->watch->scheduled(*context);
+    }
+    owner.pending.fetch_add(1, std::memory_order_relaxed);
+    deque.push(context.release());
+    owner.wake(false);
+}
+
+Context *WorkStealingScheduler::Worker::next() {
+    if (auto *context = deque.pop()) {
+        return context;
+    }
+    {
+        std::lock_guard lock(owner.injected_mutex);
+        if (!owner.injected.empty()) {
+            auto *context = owner.injected.front();
+            owner.injected.pop_front();
+            return context;
+        }
+    }
+    auto &workers = owner.workers;
+    auto start = rng() % workers.size();
+    for (size_t i = 0; i != workers.size(); ++i) {
+        auto victim = (start + i) % workers.size();
+        if (victim == index) {
+            continue;
+        }
+        if (auto *context = workers[victim]->deque.steal()) {
+            return context;
+        }
+    }
+    return nullptr;
+}
+
+Context *WorkStealingScheduler::Worker::sleep() {
+    auto epoch = owner.wake_epoch.load(std::memory_order_acquire);
+    owner.sleeping.fetch_add(1, std::memory_order_seq_cst);
+    /// Work scheduled before the increment is seen here, later one wakes us
+    auto *context = next();
+    if (!context && owner.pending.load(std::memory_order_seq_cst) != 0 &&
+        !owner.stopped.load(std::memory_order_seq_cst)) {
+        owner.wake_epoch.wait(epoch, std::memory_order_acquire);
+    }
+    owner.sleeping.fetch_sub(1, std::memory_order_relaxed);
+    return context;
+}
+
+void WorkStealingScheduler::Worker::loop() {
+    if (current_scheduler) {
+        throw std::runtime_error("Global scheduler is not empty");
+    }
+    current_scheduler = this;
+    uint32_t idle = 0;
+    while (!owner.stopped.load(std::memory_order_relaxed)) {
+        auto *context = next();
+        if (!context) {
+            if (owner.pending.load(std::memory_order_acquire) == 0) {
+                break;
+            }
+            if (++idle < IDLE_ROUNDS) {
+                std::this_thread::yield();
+                continue;
+            }
+            idle = 0;
+            context = sleep();
+            if (!context) {
+                continue;
+            }
+        }
+        idle = 0;
+        try {
+            run_context(ContextPtr(context));
+        } catch (...) {
+            owner.fail(std::current_exception());
+        }
+        if (owner.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            /// Sleepers exit the loop
+            owner.wake(true);
+        }
+    }
+    current_scheduler = nullptr;
+}
+
+WorkStealingScheduler::WorkStealingScheduler(size_t workers_count) {
+    if (workers_count == 0) {
+        workers_count = 1;
+    }
+    for (size_t i = 0; i != workers_count; ++i) {
+        workers.push_back(std::make_unique<Worker>(*this, i));
+    }
+}
+
+WorkStealingScheduler::~WorkStealingScheduler() {
+    for (auto &worker : workers) {
+        while (auto *context = worker->deque.pop()) {
+            ContextPtr{context};
+        }
+    }
+    for (auto *context : injected) {
+        ContextPtr{context};
+    }
+}
+
+void WorkStealingScheduler::inject(ContextPtr context) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(injected_mutex);
+        injected.push_back(context.release());
+    }
+    wake(false);
+}
+
+void WorkStealingScheduler::fail(std::exception_ptr error) {
+    {
+        std::lock_guard lock(injected_mutex);
+        if (!exception) {
+            exception = error;
+        }
+        stopped.store(true, std::memory_order_seq_cst);
+    }
+    wake(true);
+}
+
+void WorkStealingScheduler::wake(bool all) {
+    /// Pairs with the increment of sleeping before the last look for work
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    wake_epoch.fetch_add(1, std::memory_order_release);
+    if (all) {
+        wake_epoch.notify_all();
+    } else {
+        wake_epoch.notify_one();
+    }
+}
+
+void WorkStealingScheduler::run() {
+    stopped.store(false, std::memory_order_relaxed);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers.size(); ++i) {
+        threads.emplace_back([this, i]() {
+            try {
+                workers[i]->loop();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+    try {
+        workers[0]->loop();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (exception) {
+        std::rethrow_exception(std::exchange(exception, nullptr));
+    }
+}
+
+namespace {
+    /// Fd of an io request for tracing, -1 for sleeps
+    template <class Data>
+    [[maybe_unused]] int trace_fd(const Data &data) {
+        if constexpr (std::is_same_v<Data, TimingWheel::Clock::time_point>) {
+            return -1;
+        } else {
+            return data.fd;
+        }
+    }
+
+    template <void (IoScheduler::*Await)(ContextPtr, YieldData), class Data>
+    YieldData await(Data data) {
+        if (!current_io) {
+            throw std::runtime_error("Io scheduler is empty");
+        }
+        YieldData user_data;
+        user_data.ptr = &data;
+        return FiberScheduler::wait([](ContextPtr context, YieldData data) {
+            FIBERS_TRACE(PARK, context.get(), trace_fd(*static_cast<Data *>(data.ptr)));
+            (current_io->*Await)(std::move(context), data);
+        }, user_data);
+    }
+}
+
+namespace {
+    void wait_ready(int fd, uint32_t events, TimingWheel::Clock::time_point deadline) {
+        await<&IoScheduler::await_poll>(PollData{fd, events, deadline});
+    }
+
+    /// Inline completions in a row before a fiber goes through the scheduler anyway
+    constexpr uint32_t INLINE_BUDGET = 64;
+
+    /// Try syscall on the fiber if the backend hints fd is ready. Returns false
+    /// if the caller has to park, EAGAIN drops the hint till the next edge.
+    template <class Syscall>
+    bool try_inline(Context &context, int fd, uint32_t events, const char *what, Syscall syscall,
+                    ssize_t &result) {
+        if (!current_io || !current_io->ready_hint(fd, events)) {
+            return false;
+        }
+        if (++context.inline_ops > INLINE_BUDGET) {
+            return false;
+        }
+        result = syscall();
+        if (result >= 0) {
+            return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            current_io->clear_hint(fd, events);
+            return false;
+        }
+        if (errno == EINTR) {
+            return false;
+        }
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    /// Shared stack fibers can not let the scheduler touch their buffers while
+    /// parked: wait for readiness, then do the syscall on the fiber itself
+    template <class Syscall>
+    ssize_t on_fiber(int fd, uint32_t events, TimingWheel::Clock::time_point deadline,
+                     const char *what, Syscall syscall) {
+        while (true) {
+            wait_ready(fd, events, deadline);
+            auto r = syscall();
+            if (r >= 0) {
+                return r;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), what);
+            }
+        }
+    }
+
+    /// Inline try, then park on the fiber (shared stack) or in the backend
+    template <class Syscall, class Park>
+    ssize_t io(int fd, uint32_t events, TimingWheel::Clock::time_point deadline, const char *what,
+               Syscall syscall, Park park) {
+        auto &context = FiberScheduler::current();
+        ssize_t result;
+        if (try_inline(context, fd, events, what, syscall, result)) {
+            return result;
+        }
+        context.inline_ops = 0;
+        if (context.shared_stack) {
+            return on_fiber(fd, events, deadline, what, syscall);
+        }
+        return park();
+    }
+
+    /// Syscall on the fiber: inline try, then wait for readiness of fd before each retry
+    template <class Syscall>
+    ssize_t ready_io(int fd, uint32_t events, const char *what, Syscall syscall) {
+        auto &context = FiberScheduler::current();
+        ssize_t result;
+        if (try_inline(context, fd, events, what, syscall, result)) {
+            return result;
+        }
+        context.inline_ops = 0;
+        return on_fiber(fd, events, TimingWheel::Clock::time_point::max(), what, syscall);
+    }
+
+    /// Both ends of a nonblocking pipe, closed with the scope
+    class Pipe {
+    public:
+        Pipe() {
+            if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                throw std::system_error(errno, std::generic_category(), "pipe2");
+            }
+        }
+
+        Pipe(const Pipe &other) = delete;
+        void operator=(const Pipe &other) = delete;
+
+        ~Pipe() {
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+
+        int read_end() const {
+            return fds[0];
+        }
+
+        int write_end() const {
+            return fds[1];
+        }
+
+    private:
+        int fds[2];
+    };
+
+    /// Move data of one direction through pipe, returns bytes forwarded.
+    /// Cancelled passes through, leaving the sockets as they are.
+    size_t pump(int from, int to) {
+        Pipe pipe;
+        constexpr size_t CHUNK = 64 * 1024;
+        size_t total = 0;
+        try {
+            while (true) {
+                /// Pipe is drained after each chunk: EAGAIN is from socket only
+                auto n = ready_io(from, EPOLLIN, "splice", [&]() {
+                    return ::splice(from, nullptr, pipe.write_end(), nullptr, CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                });
+                if (n == 0) {
+                    break;
+                }
+                for (auto left = n; left > 0;) {
+                    left -= ready_io(to, EPOLLOUT, "splice", [&]() {
+                        return ::splice(pipe.read_end(), nullptr, to, nullptr, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    });
+                }
+                total += n;
+            }
+        } catch (std::system_error &) {
+            /// Reset or broken peer ends this direction only
+            shutdown(from, SHUT_RD);
+        }
+        shutdown(to, SHUT_WR);
+        return total;
+    }
+
+    void set_nonblock(int fd) {
+        auto flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw std::system_error(errno, std::generic_category(), "fcntl");
+        }
+    }
+
+    int connect_until(const sockaddr * addr, socklen_t addrlen, TimingWheel::Clock::time_point deadline) {
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        try {
+            if (::connect(fd, addr, addrlen) < 0) {
+                if (errno != EINPROGRESS && errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "connect");
+                }
+                /// Handshake result is reported by writability and SO_ERROR
+                wait_ready(fd, EPOLLOUT, deadline);
+                int error = 0;
+                socklen_t len = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+                    error = errno;
+                }
+                if (error) {
+                    throw std::system_error(error, std::generic_category(), "connect");
+                }
+            }
+        } catch (...) {
+            Async::close(fd);
+            throw;
+        }
+        return fd;
+    }
+
+    int accept_until(int fd, sockaddr * addr, socklen_t * addrlen, TimingWheel::Clock::time_point deadline) {
+        auto client = static_cast<int>(io(fd, EPOLLIN, deadline, "accept", [&]() {
+            return ::accept(fd, addr, addrlen);
+        }, [&]() {
+            /// Calls await_accept indirectly with scheduler fiber
+            return await<&IoScheduler::await_accept>(AcceptData{fd, addr, addrlen, deadline}).i;
+        }));
+        current_io->accepted(client);
+        return client;
+    }
+
+    ssize_t read_until(int fd, char * buf, size_t size, TimingWheel::Clock::time_point deadline) {
+        return io(fd, EPOLLIN, deadline, "read", [&]() {
+            return ::read(fd, buf, size);
+        }, [&]() {
+            /// Calls await_read indirectly with scheduler fiber
+            return await<&IoScheduler::await_read>(ReadData{fd, buf, size, deadline}).ss;
+        });
+    }
+
+    ssize_t write_until(int fd, const char * buf, size_t size, TimingWheel::Clock::time_point deadline) {
+        return io(fd, EPOLLOUT, deadline, "write", [&]() {
+            return send_nosignal(fd, buf, size);
+        }, [&]() {
+            /// Calls await_write indirectly with scheduler fiber
+            return await<&IoScheduler::await_write>(WriteData{fd, buf, size, deadline}).ss;
+        });
     }
 }
 
 namespace Async {
+    bool ReadAwaiter::await_ready() {
+        auto &context = FiberScheduler::current();
+        if (try_inline(context, data.fd, EPOLLIN, "read", [&]() {
+            return ::read(data.fd, data.data, data.size);
+        }, inline_result)) {
+            return true;
+        }
+        context.inline_ops = 0;
+        return false;
+    }
+
+    bool WriteAwaiter::await_ready() {
+        auto &context = FiberScheduler::current();
+        if (try_inline(context, data.fd, EPOLLOUT, "write", [&]() {
+            return send_nosignal(data.fd, data.data, data.size);
+        }, inline_result)) {
+            return true;
+        }
+        context.inline_ops = 0;
+        return false;
+    }
+
+    int AcceptAwaiter::await_resume() {
+        auto client = IoAwaiter::await_resume().i;
+        current_io->accepted(client);
+        return client;
+    }
+
     int accept(int fd, sockaddr * addr, socklen_t * addrlen) {
-        /// Calls await_accept indirectly with scheduler fiber
+        return accept_until(fd, addr, addrlen, Clock::time_point::max());
     }
 
     ssize_t read(int fd, char * buf, size_t size) {
-        /// Calls await_read indirectly with scheduler fiber
+        return read_until(fd, buf, size, Clock::time_point::max());
     }
 
     ssize_t write(int fd, const char * buf, size_t size) {
-        /// Calls await_write indirectly with scheduler fiber
+        return write_until(fd, buf, size, Clock::time_point::max());
+    }
+
+    int accept(int fd, sockaddr * addr, socklen_t * addrlen, Clock::duration timeout) {
+        return accept_until(fd, addr, addrlen, Clock::now() + timeout);
+    }
+
+    ssize_t read(int fd, char * buf, size_t size, Clock::duration timeout) {
+        return read_until(fd, buf, size, Clock::now() + timeout);
+    }
+
+    ssize_t write(int fd, const char * buf, size_t size, Clock::duration timeout) {
+        return write_until(fd, buf, size, Clock::now() + timeout);
+    }
+
+    int connect(const sockaddr * addr, socklen_t addrlen) {
+        return connect_until(addr, addrlen, Clock::time_point::max());
+    }
+
+    int connect(const sockaddr * addr, socklen_t addrlen, Clock::duration timeout) {
+        return connect_until(addr, addrlen, Clock::now() + timeout);
+    }
+
+    void sleep_until(Clock::time_point deadline) {
+        await<&IoScheduler::await_sleep>(deadline);
+    }
+
+    void sleep_for(Clock::duration duration) {
+        sleep_until(Clock::now() + duration);
+    }
+
+    ssize_t readv(int fd, const iovec * iov, int iovcnt) {
+        return ready_io(fd, EPOLLIN, "readv", [&]() {
+            return ::readv(fd, iov, iovcnt);
+        });
+    }
+
+    ssize_t writev(int fd, const iovec * iov, int iovcnt) {
+        return ready_io(fd, EPOLLOUT, "writev", [&]() {
+            msghdr msg{};
+            msg.msg_iov = const_cast<iovec *>(iov);
+            msg.msg_iovlen = iovcnt;
+            auto w = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (w < 0 && errno == ENOTSOCK) {
+                w = ::writev(fd, iov, iovcnt);
+            }
+            return w;
+        });
+    }
+
+    ssize_t splice(int fd_in, int fd_out, size_t size) {
+        /// The pipe side is expected ready, park on the other one like read or write
+        struct stat st;
+        bool from_pipe = fstat(fd_in, &st) == 0 && S_ISFIFO(st.st_mode);
+        return ready_io(from_pipe ? fd_out : fd_in, from_pipe ? EPOLLOUT : EPOLLIN, "splice", [&]() {
+            return ::splice(fd_in, nullptr, fd_out, nullptr, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        });
+    }
+
+    ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+        return ready_io(out_fd, EPOLLOUT, "sendfile", [&]() {
+            return ::sendfile(out_fd, in_fd, offset, count);
+        });
+    }
+
+    std::pair<size_t, size_t> proxy(int fd_a, int fd_b) {
+        set_nonblock(fd_a);
+        set_nonblock(fd_b);
+        /// Not on the caller's stack, a SHARED caller is swapped out meanwhile
+        auto b_to_a = std::make_shared<size_t>(0);
+        /// Cancelled proxy cancels and waits for the other direction too
+        Nursery nursery;
+        nursery.spawn([b_to_a, fd_a, fd_b]() {
+            *b_to_a = pump(fd_b, fd_a);
+        });
+        auto a_to_b = pump(fd_a, fd_b);
+        nursery.join();
+        return {a_to_b, *b_to_a};
+    }
+
+    int close(int fd) {
+        if (current_io) {
+            current_io->forget(fd);
+        }
+        return ::close(fd);
+    }
+
+    void wait_readable(int fd) {
+        wait_ready(fd, EPOLLIN, Clock::time_point::max());
+    }
+
+    void wait_writable(int fd) {
+        wait_ready(fd, EPOLLOUT, Clock::time_point::max());
+    }
+
+    size_t accept_all(int fd, std::vector<int> &clients) {
+        size_t accepted = 0;
+        while (true) {
+            auto client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (client >= 0) {
+                current_io->accepted(client);
+                clients.push_back(client);
+                ++accepted;
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (accepted) {
+                    return accepted;
+                }
+                wait_readable(fd);
+                continue;
+            }
+            if (errno == EINVAL) {
+                /// Listening socket was shut down
+                return accepted;
+            }
+            throw std::system_error(errno, std::generic_category(), "accept4");
+        }
     }
 }
@@ -1,10 +1,91 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <utility>
+
 #include "epoll.hpp"
+#include "io_uring.hpp"
+#include "work_stealing.hpp"
+#include "thread_per_core.hpp"
+#include "cancel.hpp"
+#include "join.hpp"
+#include "sync.hpp"
+#include "fiber_local.hpp"
+
+/// Stacks of all fibers, configure before scheduling
+extern StackPool stack_pool;
+
+/// Schedule to the scheduler of current thread
+void schedule(ContextPtr context);
+
+template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, ContextPtr>>>
+void schedule(F &&fiber, StackMode mode = StackMode::PRIVATE) {
+    schedule(FiberScheduler::create_context_from_fiber(std::forward<F>(fiber), mode));
+}
+
+template <class F>
+void schedule(F &&fiber, Priority priority, StackMode mode = StackMode::PRIVATE) {
+    auto context = FiberScheduler::create_context_from_fiber(std::forward<F>(fiber), mode);
+    context->priority = priority;
+    schedule(std::move(context));
+}
+
+template <class F>
+void schedule(F &&fiber, FiberScheduler::Deadline deadline, StackMode mode = StackMode::PRIVATE) {
+    auto context = FiberScheduler::create_context_from_fiber(std::forward<F>(fiber), mode);
+    context->deadline = deadline;
+    schedule(std::move(context));
+}
 
-void schedule(Fiber fiber);
 void yield();
 
 namespace Async {
     int accept(int fd, sockaddr * addr, socklen_t * addrlen);
     ssize_t read(int fd, char * data, size_t size);
     ssize_t write(int fd, const char * data, size_t size);
+
+    using Clock = TimingWheel::Clock;
+
+    /// Same as above, throw TimeoutError if not completed in timeout
+    int accept(int fd, sockaddr * addr, socklen_t * addrlen, Clock::duration timeout);
+    ssize_t read(int fd, char * data, size_t size, Clock::duration timeout);
+    ssize_t write(int fd, const char * data, size_t size, Clock::duration timeout);
+
+    /// New non-blocking stream socket connected to addr, the handshake parks
+    /// the fiber instead of the thread. Throws std::system_error on refusal.
+    int connect(const sockaddr * addr, socklen_t addrlen);
+    int connect(const sockaddr * addr, socklen_t addrlen, Clock::duration timeout);
+
+    void sleep_until(Clock::time_point deadline);
+    void sleep_for(Clock::duration duration);
+
+    /// Scatter/gather io, writev does not raise SIGPIPE on sockets
+    ssize_t readv(int fd, const iovec * iov, int iovcnt);
+    ssize_t writev(int fd, const iovec * iov, int iovcnt);
+
+    /// Move up to size bytes between fds without copying to user space, one
+    /// of them must be a pipe. Parks on the other fd, the pipe is expected
+    /// to have data or room. Returns 0 at end of input.
+    ssize_t splice(int fd_in, int fd_out, size_t size);
+
+    /// sendfile(2) from a file to out_fd parking while out_fd is full
+    ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count);
+
+    /// Forward both directions between sockets with splice through pipes till
+    /// both sides are shut down. Switches them to O_NONBLOCK, shuts down the
+    /// write side after EOF or a reset of the other. Returns bytes forwarded
+    /// a to b and b to a. Cancelling the caller stops both directions.
+    std::pair<size_t, size_t> proxy(int fd_a, int fd_b);
+
+    /// Close fd used by Async:: calls, drops its state in the io scheduler
+    int close(int fd);
+
+    /// Park fiber till fd is readable or writable
+    void wait_readable(int fd);
+    void wait_writable(int fd);
+
+    /// Wait for listening fd and drain its backlog with accept4(SOCK_NONBLOCK)
+    /// till EAGAIN. Appends clients, returns their number or 0 if fd was shut down.
+    /// fd must be non-blocking.
+    size_t accept_all(int fd, std::vector<int> &clients);
 }
@@ -1,44 +1,129 @@
-#include <queue>
+#pragma once
+
 #include <cassert>
+#include <chrono>
+#include <type_traits>
+#include <vector>
 
 #include "fibers.hpp"
+#include "tracing.hpp"
 
 class FiberScheduler {
 public:
     friend class Watch;
     /// Fiber simple trampoline
-    friend void trampoline(Fiber *fiber);  // TODO
+    friend void trampoline(Closure::Entry *entry);
+
+    /// Callback executed on scheduler stack with suspended fiber
+    using Await = void (*)(ContextPtr context, YieldData data);
+
+    struct Wait {
+        Await callback;
+        YieldData data;
+    };
+
+    using Deadline = std::chrono::steady_clock::time_point;
 
-    virtual ~FiberScheduler() {
-        assert(queue.empty());
+    enum {
+        PRIORITIES = 3,
+        /// Fiber queued this many dispatches ago runs next whatever its class
+        AGING_DISPATCHES = 1024,
+    };
+
+    virtual ~FiberScheduler();
+
+    template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, ContextPtr>>>
+    void schedule(F &&fiber, StackMode mode = StackMode::PRIVATE) {
+        schedule(create_context_from_fiber(std::forward<F>(fiber), mode));
     }
 
-    void schedule(Fiber fiber) {
-        schedule(create_context_from_fiber(std::move(fiber)));
+    template <class F>
+    void schedule(F &&fiber, Priority priority, StackMode mode = StackMode::PRIVATE) {
+        auto context = create_context_from_fiber(std::forward<F>(fiber), mode);
+        context->priority = priority;
+        schedule(std::move(context));
     }
 
-    void schedule(Context context) {
-        queue.push(std::move(context));
+    /// Earliest deadline first, ahead of all priority classes
+    template <class F>
+    void schedule(F &&fiber, Deadline deadline, StackMode mode = StackMode::PRIVATE) {
+        auto context = create_context_from_fiber(std::forward<F>(fiber), mode);
+        context->deadline = deadline;
+        schedule(std::move(context));
     }
 
+    /// Queue by context priority and deadline
+    virtual void schedule(ContextPtr context);
+
     /// Prepare stack, execution, arguments, etc...
-    static Context create_context_from_fiber(Fiber fiber);  // TODO
+    /// Callable is kept in the context or constructed right on the fiber stack, never on the heap
+    /// (except big ones for StackMode::SHARED, whose stack is not known before the first run)
+    template <class F>
+    static ContextPtr create_context_from_fiber(F &&fiber, StackMode mode = StackMode::PRIVATE) {
+        using T = std::decay_t<F>;
+        auto context = make_context();
+        context->shared_stack = mode == StackMode::SHARED;
+        if constexpr (Closure::fits_inline<T>) {
+            context->closure = Closure(std::forward<F>(fiber));
+        } else {
+            if (context->shared_stack) {
+                context->closure = Closure(Closure::Boxed<T>{std::make_unique<T>(std::forward<F>(fiber))});
+            } else {
+                auto *object = bind_stack(*context, nullptr, sizeof(T), alignof(T), &Closure::ops_of<T>);
+                new (object) T(std::forward<F>(fiber));
+            }
+        }
+        FIBERS_TRACE(SPAWN, context.get(), 0);
+        return context;
+    }
+
+    /// Context of the running fiber
+    static Context &current();
 
     /// Reschedule self to end of queue
-    static YieldData yield(YieldData);  // TODO
+    static YieldData yield(YieldData);
+
+    /// Suspend self and pass context to callback, returns data of resumed context
+    static YieldData wait(Await callback, YieldData data);
+
+    /// Suspend self into queue till someone resumes it
+    static void park(ContextQueue &queue);
+
+    /// Schedule context to the scheduler of current thread
+    static void resume(ContextPtr context);
+
+    /// wait() for a coroutine frame running as the current context: frame
+    /// is resumed on the scheduler stack once the context is scheduled
+    static void wait_frame(void *frame, Await callback, YieldData data);
+
+    /// Data the frame was resumed with, rethrows exception of the context
+    static YieldData frame_result();
 
     template <class Watch, class... Args>
     void create_current_fiber_watch(Args... args) {
-        sched_context.watch = std::make_shared<Watch>(args...);
+        sched_context->watch = std::make_shared<Watch>(args...);
     }
 
     bool empty() {
-        return queue.empty();
+        return queued == 0;
     }
 
 protected:
     /// Proceed one context from queue
-    void run_one();  // TODO
+    void run_one();
+
+    /// Proceed as many contexts as are queued now
+    void run_ready() {
+        for (auto count = queued; count != 0; --count) {
+            run_one();
+        }
+    }
+
+    /// Resume context till it yields, waits or stops
+    void run_context(ContextPtr context);
+
+    /// Resume coroutine frame of context till it awaits or ends
+    void run_frame(ContextPtr context);
 
     /// Proceed till queue is not empty
     virtual void run() {
@@ -48,6 +133,27 @@ protected:
     }
 
 private:
-    std::queue<Context> queue;
-    Context sched_context;
+    /// Switch to scheduler with action, throws if resumed with THROW
+    static YieldData suspend(Action action);
+
+    /// Top of the stack shared by StackMode::SHARED fibers, allocated on first use
+    char *shared_stack_top();
+
+    /// Give context a stack (own one if top is null) and an entry frame for a
+    /// callable of size and align, returns where the callable must be placed
+    static void *bind_stack(Context &context, char *top, size_t size, size_t align, Closure::Ops ops);
+
+    /// Next context: aged one, earliest deadline, then classes by weight
+    ContextPtr pick();
+
+    /// Run queue per Priority and min-heap of contexts with a deadline, owning
+    ContextQueue queues[PRIORITIES];
+    std::vector<Context *> deadlines;
+    /// Dispatches left to each class before credits are refilled
+    uint32_t credits[PRIORITIES] = {};
+    uint64_t dispatches = 0;
+    size_t queued = 0;
+    /// Running context
+    ContextPtr sched_context;
+    StackPool::Stack shared_stack;
 };
@@ -1,19 +1,84 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <system_error>
 #include <vector>
-#include <cstdlib>
 
 
+/// Stacks are mmap-ed with MAP_NORESERVE below a PROT_NONE guard page, so
+/// only touched pages are committed and an overflow faults instead of
+/// corrupting a neighbour. Freed stacks are cached up to max_pooled: first
+/// in a small cache of the freeing thread, taken without locking, then in
+/// the shared pool. Stacks pooled beyond hot_stacks give their pages below
+/// retain_bytes from the top back with MADV_DONTNEED.
 class StackPool {
 public:
     enum {
         STACK_SIZE = 1024 * 1024 * 4,
+        MAX_POOLED = 1024,
+        RETAIN_BYTES = 1024 * 16,
+        HOT_STACKS = 64,
+        /// Free stacks kept by each thread
+        THREAD_CACHE = 16,
+    };
+
+    struct Options {
+        size_t stack_size = STACK_SIZE;
+        /// Free stacks kept mapped, the rest are unmapped
+        size_t max_pooled = MAX_POOLED;
+        /// Committed bytes at the top of a stack kept on free
+        size_t retain_bytes = RETAIN_BYTES;
+        /// Shared pool size up to which freed stacks stay fully committed
+        size_t hot_stacks = HOT_STACKS;
+        /// Back stacks with transparent huge pages, trades lazy commit for fewer TLB misses
+        bool huge_pages = false;
+        /// Measure committed depth with mincore on free, feeds Stats::high_water
+        bool track_usage = false;
+    };
+
+    struct Stats {
+        size_t live = 0;
+        size_t pooled = 0;
+        size_t peak_live = 0;
+        /// Deepest committed stack seen on free, bytes (track_usage only)
+        size_t high_water = 0;
     };
 
+    StackPool() : StackPool(Options()) {
+    }
+
+    explicit StackPool(Options options) : id(++last_id) {
+        configure(options);
+        std::lock_guard lock(registry_mutex);
+        registry.push_back(this);
+    }
+
     ~StackPool() {
+        {
+            std::lock_guard lock(registry_mutex);
+            registry.erase(std::find(registry.begin(), registry.end(), this));
+        }
+        auto &cache = thread_cache();
+        if (cache.pool == this) {
+            cache.release();
+        }
         for (auto elem : stacks) {
-            std::free(elem);
+            unmap(elem);
         }
     }
 
+    StackPool(const StackPool &other) = delete;
+    void operator=(const StackPool &other) = delete;
+
     struct Stack {
         StackPool *sp = nullptr;
         void *ptr = nullptr;
@@ -41,6 +106,11 @@ public:
         Stack(const Stack &other) = delete;
         void operator=(const Stack &other) = delete;
 
+        /// Initial stack pointer, stack grows down from here
+        void *top() const {
+            return static_cast<char *>(ptr) + sp->stack_size();
+        }
+
         void free() noexcept {
             if (!ptr) {
                 return;
@@ -50,20 +120,227 @@ public:
         }
     };
 
+    /// Change options, only while no stack is live. Stacks cached by
+    /// threads before are unmapped when those threads use the pool again.
+    void configure(Options new_options) {
+        std::lock_guard lock(mutex);
+        if (live.load(std::memory_order_relaxed)) {
+            throw std::logic_error("StackPool reconfigured with live stacks");
+        }
+        for (auto elem : stacks) {
+            unmap(elem);
+        }
+        stacks.clear();
+        pooled.store(0, std::memory_order_relaxed);
+        ++generation;
+        page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        new_options.stack_size = (std::max(new_options.stack_size, page) + page - 1) / page * page;
+        options = new_options;
+    }
+
+    size_t stack_size() const {
+        return options.stack_size;
+    }
+
     Stack alloc() {
-        if (!stacks.empty()) {
-            auto ptr = stacks.back();
-            stacks.pop_back();
-            return {this, ptr};
+        auto now = live.fetch_add(1, std::memory_order_relaxed) + 1;
+        raise(peak_live, now);
+        auto &cache = own_cache();
+        if (cache.size) {
+            pooled.fetch_sub(1, std::memory_order_relaxed);
+            return {this, cache.stacks[--cache.size]};
+        }
+        {
+            std::lock_guard lock(mutex);
+            if (!stacks.empty()) {
+                auto ptr = stacks.back();
+                stacks.pop_back();
+                pooled.fetch_sub(1, std::memory_order_relaxed);
+                return {this, ptr};
+            }
+        }
+        try {
+            return {this, map()};
+        } catch (...) {
+            live.fetch_sub(1, std::memory_order_relaxed);
+            throw;
         }
-        auto ptr = std::calloc(1, STACK_SIZE);
-        return {this, ptr};
     }
 
     void free(void *stack) {
+        live.fetch_sub(1, std::memory_order_relaxed);
+        if (options.track_usage) {
+            raise(high_water, committed(stack));
+        }
+        if (pooled.load(std::memory_order_relaxed) >= options.max_pooled) {
+            unmap(stack);
+            return;
+        }
+        pooled.fetch_add(1, std::memory_order_relaxed);
+        auto &cache = own_cache();
+        if (cache.size != THREAD_CACHE) {
+            cache.stacks[cache.size++] = stack;
+            return;
+        }
+        std::lock_guard lock(mutex);
+        if (stacks.size() >= options.hot_stacks && options.stack_size > options.retain_bytes) {
+            madvise(stack, options.stack_size - options.retain_bytes, MADV_DONTNEED);
+        }
         stacks.push_back(stack);
     }
 
+    /// Give back pages of stack in use below sp, so that committed() counts
+    /// only pages touched afterwards. The page under the one of sp is kept
+    /// for frames of the caller.
+    void discard_below(void *stack, const void *sp) const {
+        auto begin = reinterpret_cast<uintptr_t>(stack);
+        auto end = (reinterpret_cast<uintptr_t>(sp) & ~(page - 1)) - page;
+        if (end > begin) {
+            madvise(stack, end - begin, MADV_DONTNEED);
+        }
+    }
+
+    /// Bytes from the lowest resident page of stack to the top, a page
+    /// granular high water mark of a stack in use
+    size_t committed(const void *stack) const {
+        std::vector<unsigned char> resident(options.stack_size / page);
+        if (mincore(const_cast<void *>(stack), options.stack_size, resident.data()) != 0) {
+            return 0;
+        }
+        auto it = std::find_if(resident.begin(), resident.end(), [](unsigned char flag) {
+            return flag & 1;
+        });
+        return (resident.end() - it) * page;
+    }
+
+    Stats stats() const {
+        Stats current;
+        current.live = live.load(std::memory_order_relaxed);
+        current.pooled = pooled.load(std::memory_order_relaxed);
+        current.peak_live = peak_live.load(std::memory_order_relaxed);
+        current.high_water = high_water.load(std::memory_order_relaxed);
+        return current;
+    }
+
+    void report(std::ostream &out) const {
+        auto current = stats();
+        out << "stacks: size " << stack_size()
+            << " live " << current.live
+            << " peak " << current.peak_live
+            << " pooled " << current.pooled
+            << " high water " << current.high_water << '\n';
+    }
+
 private:
+    /// Free stacks of one pool cached by a thread, the pool is the last one
+    /// the thread freed to or allocated from
+    struct ThreadCache {
+        StackPool *pool = nullptr;
+        uint64_t id = 0;
+        uint64_t generation = 0;
+        size_t page = 0;
+        size_t stack_size = 0;
+        size_t size = 0;
+        void *stacks[THREAD_CACHE];
+
+        /// Hand stacks back to the pool, unmap them if it is gone or was reconfigured
+        void release() {
+            {
+                std::lock_guard lock(registry_mutex);
+                auto alive = std::find(registry.begin(), registry.end(), pool) != registry.end() &&
+                             pool->id == id;
+                if (alive && pool->generation == generation) {
+                    std::lock_guard pool_lock(pool->mutex);
+                    pool->stacks.insert(pool->stacks.end(), stacks, stacks + size);
+                    size = 0;
+                }
+            }
+            for (size_t i = 0; i != size; ++i) {
+                munmap(static_cast<char *>(stacks[i]) - page, stack_size + page);
+            }
+            size = 0;
+            pool = nullptr;
+        }
+    };
+
+    /// Releases the cache at thread exit, the cache itself stays valid for
+    /// pools destroyed after thread locals
+    struct CacheRelease {
+        ThreadCache &cache;
+
+        ~CacheRelease() {
+            if (cache.pool) {
+                cache.release();
+            }
+        }
+    };
+
+    static ThreadCache &thread_cache() {
+        static thread_local ThreadCache cache;
+        static thread_local CacheRelease release{cache};
+        return cache;
+    }
+
+    /// Cache of this thread bound to this pool
+    ThreadCache &own_cache() {
+        auto &cache = thread_cache();
+        if (cache.pool != this || cache.id != id || cache.generation != generation) {
+            if (cache.pool) {
+                cache.release();
+            }
+            cache.pool = this;
+            cache.id = id;
+            cache.generation = generation;
+            cache.page = page;
+            cache.stack_size = options.stack_size;
+        }
+        return cache;
+    }
+
+    static void raise(std::atomic<size_t> &mark, size_t value) {
+        auto current = mark.load(std::memory_order_relaxed);
+        while (current < value && !mark.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void *map() {
+        auto total = options.stack_size + page;
+        auto *base = mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        /// Guard page at the low end, stacks grow down into it
+        if (mprotect(base, page, PROT_NONE) != 0) {
+            auto error = errno;
+            munmap(base, total);
+            throw std::system_error(error, std::generic_category(), "mprotect");
+        }
+        auto *stack = static_cast<char *>(base) + page;
+        if (options.huge_pages) {
+            madvise(stack, options.stack_size, MADV_HUGEPAGE);
+        }
+        return stack;
+    }
+
+    void unmap(void *stack) {
+        munmap(static_cast<char *>(stack) - page, options.stack_size + page);
+    }
+
+    /// Pools alive, thread caches check theirs before handing stacks back
+    static inline std::mutex registry_mutex;
+    static inline std::vector<StackPool *> registry;
+    static inline std::atomic<uint64_t> last_id{0};
+
+    /// Stacks migrate between worker threads with their fibers
+    mutable std::mutex mutex;
+    Options options;
+    size_t page = 0;
+    uint64_t id;
+    uint64_t generation = 0;
+    std::atomic<size_t> live{0};
+    std::atomic<size_t> pooled{0};
+    std::atomic<size_t> peak_live{0};
+    std::atomic<size_t> high_water{0};
     std::vector<void *> stacks;
 };
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cassert>
+#include <deque>
+#include <optional>
+
+#include "cancel.hpp"
+#include "scheduler.hpp"
+
+/// Synchronization of fibers of one scheduler thread. Waiting fibers are
+/// parked in an intrusive queue of the primitive and scheduled back by the
+/// fiber releasing it, no yield loops. Not thread safe: fibers of
+/// WorkStealingScheduler must not share them.
+
+/// Ownership is handed directly to the first waiter, so unlock is fair
+class Mutex {
+public:
+    Mutex() = default;
+
+    Mutex(const Mutex &other) = delete;
+    void operator=(const Mutex &other) = delete;
+
+    ~Mutex() {
+        assert(waiters.empty());
+    }
+
+    void lock() {
+        if (!locked) {
+            locked = true;
+            return;
+        }
+        /// Resumed already owning the mutex
+        FiberScheduler::park(waiters);
+    }
+
+    bool try_lock() {
+        if (locked) {
+            return false;
+        }
+        locked = true;
+        return true;
+    }
+
+    void unlock() {
+        if (waiters.empty()) {
+            locked = false;
+        } else {
+            FiberScheduler::resume(waiters.pop());
+        }
+    }
+
+private:
+    bool locked = false;
+    ContextQueue waiters;
+};
+
+class ConditionVariable {
+public:
+    ConditionVariable() = default;
+
+    ConditionVariable(const ConditionVariable &other) = delete;
+    void operator=(const ConditionVariable &other) = delete;
+
+    ~ConditionVariable() {
+        assert(waiters.empty());
+    }
+
+    /// Fibers do not run till this one is parked, so unlock and park are atomic.
+    /// Mutex is locked again on return and on Cancelled, so callers unlock it.
+    void wait(Mutex &mutex) {
+        mutex.unlock();
+        try {
+            FiberScheduler::park(waiters);
+        } catch (...) {
+            relock(mutex);
+            throw;
+        }
+        relock(mutex);
+    }
+
+    template <class Predicate>
+    void wait(Mutex &mutex, Predicate predicate) {
+        while (!predicate()) {
+            wait(mutex);
+        }
+    }
+
+    void notify_one() {
+        if (!waiters.empty()) {
+            FiberScheduler::resume(waiters.pop());
+        }
+    }
+
+    void notify_all() {
+        while (!waiters.empty()) {
+            FiberScheduler::resume(waiters.pop());
+        }
+    }
+
+private:
+    static void relock(Mutex &mutex) {
+        CancelShield shield;
+        mutex.lock();
+    }
+
+    ContextQueue waiters;
+};
+
+/// Counting semaphore, a released unit is handed directly to the first waiter
+class Semaphore {
+public:
+    explicit Semaphore(size_t count = 0) : count(count) {
+    }
+
+    Semaphore(const Semaphore &other) = delete;
+    void operator=(const Semaphore &other) = delete;
+
+    ~Semaphore() {
+        assert(waiters.empty());
+    }
+
+    void acquire() {
+        if (count) {
+            --count;
+            return;
+        }
+        FiberScheduler::park(waiters);
+    }
+
+    bool try_acquire() {
+        if (!count) {
+            return false;
+        }
+        --count;
+        return true;
+    }
+
+    void release(size_t n = 1) {
+        for (; n && !waiters.empty(); --n) {
+            FiberScheduler::resume(waiters.pop());
+        }
+        count += n;
+    }
+
+    size_t available() const {
+        return count;
+    }
+
+private:
+    size_t count;
+    ContextQueue waiters;
+};
+
+/// Bounded multi-producer multi-consumer queue. Senders park while it is
+/// full, receivers while it is empty. After close() sends fail and receivers
+/// drain the rest, then get nullopt.
+template <class T>
+class Channel {
+public:
+    explicit Channel(size_t capacity) : capacity(capacity ? capacity : 1) {
+    }
+
+    Channel(const Channel &other) = delete;
+    void operator=(const Channel &other) = delete;
+
+    ~Channel() {
+        assert(senders.empty() && receivers.empty());
+    }
+
+    /// False if channel is closed
+    bool send(T value) {
+        while (!closed && items.size() == capacity) {
+            FiberScheduler::park(senders);
+        }
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(value));
+        wake(receivers);
+        return true;
+    }
+
+    /// Send [first, last) filling free space at once, parks only when full.
+    /// Returns number of values sent, less than all if channel got closed.
+    template <class Iterator>
+    size_t send_batch(Iterator first, Iterator last) {
+        size_t sent = 0;
+        while (first != last) {
+            while (!closed && items.size() == capacity) {
+                FiberScheduler::park(senders);
+            }
+            if (closed) {
+                break;
+            }
+            for (; first != last && items.size() != capacity; ++first, ++sent) {
+                items.push_back(std::move(*first));
+            }
+            wake_all(receivers);
+        }
+        return sent;
+    }
+
+    /// nullopt once channel is closed and drained
+    std::optional<T> receive() {
+        while (items.empty() && !closed) {
+            FiberScheduler::park(receivers);
+        }
+        if (items.empty()) {
+            return std::nullopt;
+        }
+        std::optional<T> value(std::move(items.front()));
+        items.pop_front();
+        wake(senders);
+        return value;
+    }
+
+    /// Wait for at least one value and move up to max ones to out.
+    /// Returns number of values received, 0 once channel is closed and drained.
+    template <class OutputIterator>
+    size_t receive_batch(OutputIterator out, size_t max) {
+        while (items.empty() && !closed) {
+            FiberScheduler::park(receivers);
+        }
+        size_t received = 0;
+        for (; received != max && !items.empty(); ++received) {
+            *out++ = std::move(items.front());
+            items.pop_front();
+        }
+        wake_all(senders);
+        return received;
+    }
+
+    /// Wake all parked fibers, pending values stay receivable
+    void close() {
+        closed = true;
+        wake_all(senders);
+        wake_all(receivers);
+    }
+
+    bool is_closed() const {
+        return closed;
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+private:
+    static void wake(ContextQueue &queue) {
+        if (!queue.empty()) {
+            FiberScheduler::resume(queue.pop());
+        }
+    }
+
+    static void wake_all(ContextQueue &queue) {
+        while (!queue.empty()) {
+            FiberScheduler::resume(queue.pop());
+        }
+    }
+
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    ContextQueue senders;
+    ContextQueue receivers;
+};
@@ -0,0 +1,95 @@
+#include "task.hpp"
+
+namespace {
+    struct FreeFrame {
+        FreeFrame *next;
+    };
+
+    /// Freed frames of this thread per size class
+    struct FrameCache {
+        FreeFrame *heads[Async::FramePool::CLASSES] = {};
+        size_t sizes[Async::FramePool::CLASSES] = {};
+
+        ~FrameCache() {
+            for (auto *&head : heads) {
+                while (head) {
+                    ::operator delete(std::exchange(head, head->next));
+                }
+            }
+        }
+    };
+
+    thread_local FrameCache frame_cache;
+}
+
+namespace Async {
+
+    void *FramePool::allocate(size_t size) {
+        auto index = (size - 1) / GRANULARITY;
+        if (index >= CLASSES) {
+            return ::operator new(size);
+        }
+        auto &cache = frame_cache;
+        if (auto *frame = cache.heads[index]) {
+            cache.heads[index] = frame->next;
+            --cache.sizes[index];
+            return frame;
+        }
+        return ::operator new((index + 1) * GRANULARITY);
+    }
+
+    void FramePool::deallocate(void *frame, size_t size) {
+        auto index = (size - 1) / GRANULARITY;
+        auto &cache = frame_cache;
+        if (index >= CLASSES || cache.sizes[index] == MAX_CACHED) {
+            ::operator delete(frame);
+            return;
+        }
+        ++cache.sizes[index];
+        cache.heads[index] = new (frame) FreeFrame{cache.heads[index]};
+    }
+
+    std::coroutine_handle<> TaskPromiseBase::finish(std::coroutine_handle<> handle) noexcept {
+        if (continuation) {
+            return continuation;
+        }
+        if (exception) {
+            FiberScheduler::current().exception = std::move(exception);
+        }
+        handle.destroy();
+        return std::noop_coroutine();
+    }
+
+    namespace {
+        ContextPtr make_task_context(Task<void> task) {
+            auto context = make_context();
+            context->frame = task.release().address();
+            FIBERS_TRACE(SPAWN, context.get(), 0);
+            return context;
+        }
+    }
+
+    void start(Task<void> task) {
+        FiberScheduler::resume(make_task_context(std::move(task)));
+    }
+
+    void start(FiberScheduler &sched, Task<void> task) {
+        sched.schedule(make_task_context(std::move(task)));
+    }
+
+    void destroy_frame(void *frame) {
+        /// Promises of all tasks start with TaskPromiseBase
+        auto handle = std::coroutine_handle<TaskPromiseBase>::from_address(frame);
+        while (auto continuation = handle.promise().continuation) {
+            handle = std::coroutine_handle<TaskPromiseBase>::from_address(continuation.address());
+        }
+        handle.destroy();
+    }
+
+    void YieldAwaiter::await_suspend(std::coroutine_handle<> handle) {
+        FiberScheduler::wait_frame(handle.address(), [](ContextPtr context, YieldData) {
+            FiberScheduler::resume(std::move(context));
+        }, {});
+    }
+
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "runtime.hpp"
+
+/// Stackless C++20 coroutines on the same schedulers as fibers. A started
+/// Async::Task runs as a context without a stack: awaiting io hands the
+/// context to the io backend exactly like a parked fiber, and the scheduler
+/// resumes the coroutine frame instead of switching stacks. A task costs
+/// its frame, a few hundred bytes from a per-thread pool.
+///
+///     Async::Task<size_t> echo(int fd) {
+///         char buf[4096];
+///         ssize_t r;
+///         while ((r = co_await Async::async_read(fd, buf, sizeof(buf))) > 0) {
+///             co_await Async::async_write(fd, buf, r);
+///         }
+///         ...
+///     }
+///
+///     Async::start(handle(fd));
+///
+/// Tasks must not call the blocking Async:: functions of fibers, nor use
+/// sync.hpp primitives. Frames are resumed on the thread which scheduled
+/// them, so run tasks on IoSchedulers only.
+namespace Async {
+
+    /// Coroutine frames by size class, cached per thread like contexts
+    class FramePool {
+    public:
+        enum {
+            GRANULARITY = 64,
+            CLASSES = 16,
+            /// Free frames kept per class
+            MAX_CACHED = 1024,
+        };
+
+        static void *allocate(size_t size);
+
+        static void deallocate(void *frame, size_t size);
+    };
+
+    class TaskPromiseBase {
+    public:
+        static void *operator new(size_t size) {
+            return FramePool::allocate(size);
+        }
+
+        static void operator delete(void *frame, size_t size) {
+            FramePool::deallocate(frame, size);
+        }
+
+        /// Lazy: body runs once awaited or started
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            template <class Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                return handle.promise().finish(handle);
+            }
+
+            void await_resume() noexcept {
+            }
+        };
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+
+        /// Awaiting task to continue with, or end of a started one: its
+        /// exception goes to the context and the frame is freed
+        std::coroutine_handle<> finish(std::coroutine_handle<> handle) noexcept;
+
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+    };
+
+    template <class T>
+    class TaskPromise : public TaskPromiseBase {
+    public:
+        template <class U>
+        void return_value(U &&result) {
+            value.emplace(std::forward<U>(result));
+        }
+
+        T result() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+            return std::move(*value);
+        }
+
+    private:
+        std::optional<T> value;
+    };
+
+    template <>
+    class TaskPromise<void> : public TaskPromiseBase {
+    public:
+        void return_void() {
+        }
+
+        void result() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+
+    /// Coroutine returning T to the task awaiting it
+    template <class T = void>
+    class [[nodiscard]] Task {
+    public:
+        class promise_type : public TaskPromise<T> {
+        public:
+            Task get_return_object() {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+        };
+
+        class Awaiter {
+        public:
+            explicit Awaiter(std::coroutine_handle<promise_type> handle) : handle(handle) {
+            }
+
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            /// Run the child right away, it continues the awaiting task at its end
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume() {
+                return handle.promise().result();
+            }
+
+        private:
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {
+        }
+
+        Task &operator=(Task &&other) noexcept {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+
+        ~Task() {
+            if (handle) {
+                handle.destroy();
+            }
+        }
+
+        Awaiter operator co_await() const noexcept {
+            return Awaiter(handle);
+        }
+
+        /// Frame of the task not awaited yet, caller owns it
+        std::coroutine_handle<> release() {
+            return std::exchange(handle, {});
+        }
+
+    private:
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {
+        }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    /// Run task on the scheduler of current thread, its frame is freed at
+    /// the end. Exceptions other than Cancelled propagate from scheduler_run.
+    void start(Task<void> task);
+
+    /// Same on sched, e.g. before scheduler_run
+    void start(FiberScheduler &sched, Task<void> task);
+
+    /// Free the frames of a started task which will not be resumed, given
+    /// its innermost awaiting frame: awaiting tasks own their children, so
+    /// the root one is destroyed
+    void destroy_frame(void *frame);
+
+    /// Parks the awaiting task in IoScheduler::await_* with data
+    template <void (IoScheduler::*Await)(ContextPtr, YieldData), class Data>
+    class IoAwaiter {
+    public:
+        explicit IoAwaiter(Data data) : data(data) {
+        }
+
+        bool await_ready() {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            YieldData user_data;
+            user_data.ptr = &data;
+            FiberScheduler::wait_frame(handle.address(), [](ContextPtr context, YieldData data) {
+                if constexpr (std::is_same_v<Data, Clock::time_point>) {
+                    FIBERS_TRACE(PARK, context.get(), -1);
+                } else {
+                    FIBERS_TRACE(PARK, context.get(), static_cast<Data *>(data.ptr)->fd);
+                }
+                (IoScheduler::running().*Await)(std::move(context), data);
+            }, user_data);
+        }
+
+        YieldData await_resume() {
+            return FiberScheduler::frame_result();
+        }
+
+    protected:
+        Data data;
+    };
+
+    /// Tries the syscall before parking when the backend hints fd is ready
+    class ReadAwaiter : public IoAwaiter<&IoScheduler::await_read, ReadData> {
+    public:
+        using IoAwaiter::IoAwaiter;
+
+        bool await_ready();
+
+        ssize_t await_resume() {
+            return inline_result >= 0 ? inline_result : IoAwaiter::await_resume().ss;
+        }
+
+    private:
+        ssize_t inline_result = -1;
+    };
+
+    class WriteAwaiter : public IoAwaiter<&IoScheduler::await_write, WriteData> {
+    public:
+        using IoAwaiter::IoAwaiter;
+
+        bool await_ready();
+
+        ssize_t await_resume() {
+            return inline_result >= 0 ? inline_result : IoAwaiter::await_resume().ss;
+        }
+
+    private:
+        ssize_t inline_result = -1;
+    };
+
+    class AcceptAwaiter : public IoAwaiter<&IoScheduler::await_accept, AcceptData> {
+    public:
+        using IoAwaiter::IoAwaiter;
+
+        int await_resume();
+    };
+
+    class SleepAwaiter : public IoAwaiter<&IoScheduler::await_sleep, Clock::time_point> {
+    public:
+        using IoAwaiter::IoAwaiter;
+
+        void await_resume() {
+            IoAwaiter::await_resume();
+        }
+    };
+
+    /// Requeue the awaiting task behind ready fibers and tasks
+    class YieldAwaiter {
+    public:
+        bool await_ready() {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle);
+
+        void await_resume() {
+            FiberScheduler::frame_result();
+        }
+    };
+
+    /// Awaitable counterparts of the fiber Async:: calls
+    inline ReadAwaiter async_read(int fd, char * data, size_t size) {
+        return ReadAwaiter(ReadData{fd, data, size});
+    }
+
+    inline ReadAwaiter async_read(int fd, char * data, size_t size, Clock::duration timeout) {
+        return ReadAwaiter(ReadData{fd, data, size, Clock::now() + timeout});
+    }
+
+    inline WriteAwaiter async_write(int fd, const char * data, size_t size) {
+        return WriteAwaiter(WriteData{fd, data, size});
+    }
+
+    inline WriteAwaiter async_write(int fd, const char * data, size_t size, Clock::duration timeout) {
+        return WriteAwaiter(WriteData{fd, data, size, Clock::now() + timeout});
+    }
+
+    inline AcceptAwaiter async_accept(int fd, sockaddr * addr, socklen_t * addrlen) {
+        return AcceptAwaiter(AcceptData{fd, addr, addrlen});
+    }
+
+    inline SleepAwaiter async_sleep_until(Clock::time_point deadline) {
+        return SleepAwaiter(deadline);
+    }
+
+    inline SleepAwaiter async_sleep_for(Clock::duration duration) {
+        return SleepAwaiter(Clock::now() + duration);
+    }
+
+    inline YieldAwaiter async_yield() {
+        return {};
+    }
+
+}
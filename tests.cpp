@@ -1,4 +1,9 @@
 #include "runtime.hpp"
+#include "buffered.hpp"
+#include "connection_pool.hpp"
+#include "profiling.hpp"
+#include "tracing.hpp"
+#include "task.hpp"
 
 #include <iostream>
 #include <sys/socket.h>
@@ -8,6 +13,31 @@
 #include <sstream>
 #include <cstring>
 #include <random>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <csignal>
+#include <atomic>
+#include <array>
+#include <numeric>
+#include <mutex>
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
 
 void test_simple() {
     std::cout << __FUNCTION__ << std::endl;
@@ -168,6 +198,31 @@ int prepare_client_sock(short port) {
     return sock;
 }
 
+sockaddr_in loopback(short port) {
+    sockaddr_in addr = {AF_INET};
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    return addr;
+}
+
+/// Port nobody listens on: bound by the kernel, then released
+short closed_loopback_port() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    auto addr = loopback(0);
+    assert(bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(sock, (sockaddr*)&addr, &len) == 0);
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+/// Connect without blocking the scheduler thread
+int async_client_sock(short port) {
+    auto addr = loopback(port);
+    return Async::connect((sockaddr*)&addr, sizeof(addr));
+}
+
 void write_all(int fd, const char * data, size_t size) {
     while (size > 0) {
         auto w = Async::write(fd, data, size);
@@ -191,8 +246,8 @@ void test_simple_server_client() {
         std::cout << msg.data() << std::endl;
         auto w = Async::write(client, msg.data(), r);
         assert(r == w);
-        close(client);
-        close(sock);
+        Async::close(client);
+        Async::close(sock);
     };
 
     auto client = [](){
@@ -215,6 +270,7 @@ void test_simple_server_client() {
     scheduler_run(sched);
 }
 
+template <class Scheduler = EpollScheduler>
 void test_server_many_clients() {
     std::cout << __FUNCTION__ << std::endl;
 
@@ -236,11 +292,11 @@ void test_server_many_clients() {
                     assert(r > 0);
                     write_all(client_fd, buf.data(), r);
                 }
-                close(client_fd);
+                Async::close(client_fd);
             };
             schedule(echo);
         }
-        close(sock);
+        Async::close(sock);
     };
 
     auto client = [=](){
@@ -260,12 +316,12 @@ void test_server_many_clients() {
             assert(msg == res.substr(0, msg.size()));
         }
         for (auto && sock : socks) {
-            close(sock);
+            Async::close(sock);
         }
         std::cout << "Done" << std::endl;
     };
 
-    EpollScheduler sched;
+    Scheduler sched;
 
     sched.schedule(server);
     sched.schedule(client);
@@ -294,11 +350,11 @@ void test_server_many_clients2() {
                     assert(r > 0);
                     write_all(client_fd, buf.data(), r);
                 }
-                close(client_fd);
+                Async::close(client_fd);
             };
             schedule(echo);
         }
-        close(sock);
+        Async::close(sock);
     };
 
     auto client = [=](){
@@ -313,7 +369,7 @@ void test_server_many_clients2() {
         yield();
         assert(r == msg.size());
         assert(msg == res.substr(0, msg.size()));
-        close(sock);
+        Async::close(sock);
         yield();
         yield();
         yield();
@@ -330,6 +386,7 @@ void test_server_many_clients2() {
     scheduler_run(sched);
 }
 
+template <class Scheduler = EpollScheduler>
 void test_supertest() {
     std::cout << __FUNCTION__ << std::endl;
 
@@ -342,7 +399,7 @@ void test_supertest() {
 
         for (int i = 0; i != clients; ++i) {
             auto client_fd = Async::accept(sock, nullptr, nullptr);
-            auto server_fd = prepare_client_sock(port);
+            auto server_fd = async_client_sock(port);
             auto client_to_server = [=]() {
                 std::vector<char> buf(1024);
                 try {
@@ -378,7 +435,7 @@ void test_supertest() {
             schedule(client_to_server);
             schedule(server_to_client);
         }
-        close(sock);
+        Async::close(sock);
     };
 
     std::unordered_map<std::string, std::string> database;
@@ -440,7 +497,8 @@ void test_supertest() {
                     std::istringstream iss(line);
                     std::string cmd;
                     iss >> cmd;
-                    if (cmd == "STOP") {
+                    /// Empty line is end of input: the peer is gone, do not answer it
+                    if (line.empty() || cmd == "STOP") {
                         break;
                     }
                     std::string key;
@@ -463,11 +521,11 @@ void test_supertest() {
                     auto res = oss.str();
                     write_all(client_fd, res.data(), res.size());
                 }
-                close(client_fd);
+                Async::close(client_fd);
             };
             schedule(client);
         }
-        close(sock);
+        Async::close(sock);
     };
 
     std::vector<std::string> keys = {
@@ -504,7 +562,7 @@ void test_supertest() {
             write_all(sock, cmd.data(), cmd.size());
             input.get_line();
         }
-        close(sock);
+        Async::close(sock);
     };
 
     auto client0 = [&](){
@@ -523,10 +581,10 @@ void test_supertest() {
         doo("GET B", "None");
         doo("PUT A 20", "Ok");
         doo("GET A", "20");
-        close(sock);
+        Async::close(sock);
     };
 
-    EpollScheduler sched;
+    Scheduler sched;
 
     sched.schedule(proxy_server);
     sched.schedule(server);
@@ -538,6 +596,1691 @@ void test_supertest() {
     scheduler_run(sched);
 }
 
+void test_work_stealing() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr int fibers = 100;
+
+    std::atomic<int> x = 0;
+    std::atomic<int> done = 0;
+
+    WorkStealingScheduler sched(4);
+
+    for (int i = 0; i != fibers; ++i) {
+        sched.schedule([&]() {
+            for (int j = 0; j != ITERS; ++j) {
+                ++x;
+                yield();
+            }
+            schedule([&]() {
+                ++done;
+            });
+        });
+    }
+
+    sched.run();
+
+    assert(x == fibers * ITERS);
+    assert(done == fibers);
+
+    /// Workers asleep after idling wake up for new work: each fiber blocks
+    /// its thread till all of them started, so three threads must run them
+    std::atomic<int> started = 0;
+    sched.schedule([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        for (int i = 0; i != 3; ++i) {
+            schedule([&]() {
+                ++started;
+                while (started != 3) {
+                    std::this_thread::yield();
+                }
+            });
+        }
+    });
+
+    sched.run();
+
+    assert(started == 3);
+    std::cout << "Done" << std::endl;
+}
+
+void test_thread_per_core() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr short port = 8090;
+    constexpr int clients = 20;
+
+    ThreadPerCore cores(2);
+    std::vector<int> listen_socks(cores.cores_count(), -1);
+    std::atomic<size_t> listening = 0;
+    std::atomic<int> accepted = 0;
+
+    std::thread connector([&]() {
+        while (listening != listen_socks.size()) {
+            std::this_thread::yield();
+        }
+        std::vector<int> socks;
+        for (int i = 0; i != clients; ++i) {
+            socks.push_back(prepare_client_sock(port));
+        }
+        while (accepted != clients) {
+            std::this_thread::yield();
+        }
+        for (auto sock : listen_socks) {
+            shutdown(sock, SHUT_RD);
+        }
+        for (auto sock : socks) {
+            Async::close(sock);
+        }
+    });
+
+    cores.run([&](size_t core) {
+        auto sock = listen_reuseport(port);
+        listen_socks[core] = sock;
+        ++listening;
+        std::vector<int> fds;
+        while (Async::accept_all(sock, fds) != 0) {
+            accepted += fds.size();
+            for (auto fd : fds) {
+                Async::close(fd);
+            }
+            fds.clear();
+        }
+        Async::close(sock);
+    });
+    connector.join();
+
+    assert(accepted == clients);
+    std::cout << "Done" << std::endl;
+}
+
+void test_io_uring_fixed() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    std::array<char, 64> in{};
+    std::array<char, 64> out{};
+    std::string msg = "Registered buffers";
+    memcpy(out.data(), msg.data(), msg.size());
+
+    IoUringScheduler sched;
+    sched.register_files({fds[0], fds[1]});
+    sched.register_buffers({{in.data(), in.size()}, {out.data(), out.size()}});
+
+    sched.schedule([&]() {
+        auto r = Async::read(fds[0], in.data(), in.size());
+        assert(r == static_cast<ssize_t>(msg.size()));
+        assert(msg == std::string(in.data(), r));
+    });
+    sched.schedule([&]() {
+        auto w = Async::write(fds[1], out.data(), msg.size());
+        assert(w == static_cast<ssize_t>(msg.size()));
+    });
+
+    scheduler_run(sched);
+
+    /// More requests in flight than the ring has entries
+    IoUringScheduler small(4);
+    constexpr int pairs = 32;
+    int sockets[pairs][2];
+    int echoed = 0;
+    for (auto &pair : sockets) {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+        small.schedule([&]() {
+            char c;
+            assert(Async::read(pair[0], &c, 1) == 1 && c == 'x');
+            ++echoed;
+        });
+    }
+    for (auto &pair : sockets) {
+        small.schedule([&]() {
+            assert(Async::write(pair[1], "x", 1) == 1);
+        });
+    }
+
+    scheduler_run(small);
+
+    assert(echoed == pairs);
+    for (auto &pair : sockets) {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    std::cout << "Done" << std::endl;
+}
+
+template <class Scheduler>
+void test_timers() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    using namespace std::chrono_literals;
+
+    std::vector<int> order;
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    Scheduler sched;
+
+    auto start = Async::Clock::now();
+    for (int delay : {30, 10, 20}) {
+        sched.schedule([&, delay]() {
+            Async::sleep_for(std::chrono::milliseconds(delay));
+            order.push_back(delay);
+        });
+    }
+    sched.schedule([&]() {
+        char buf[16];
+        try {
+            Async::read(fds[0], buf, sizeof(buf), 5ms);
+            assert(false);
+        } catch (TimeoutError &) {
+        }
+        auto w = Async::write(fds[1], "x", 1, 5ms);
+        assert(w == 1);
+        auto r = Async::read(fds[0], buf, sizeof(buf), 5ms);
+        assert(r == 1);
+    });
+
+    scheduler_run(sched);
+
+    assert(Async::Clock::now() - start >= 30ms);
+    assert((order == std::vector<int>{10, 20, 30}));
+    close(fds[0]);
+    close(fds[1]);
+    std::cout << "Done" << std::endl;
+}
+
+void test_stack_pool() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    StackPool::Options options;
+    options.stack_size = 64 * 1024;
+    options.max_pooled = 1;
+    options.track_usage = true;
+    StackPool pool(options);
+
+    {
+        auto first = pool.alloc();
+        auto second = pool.alloc();
+        assert(pool.stats().live == 2);
+        /// Touch 20KB from the top as a fiber would
+        memset(static_cast<char *>(first.top()) - 20 * 1024, 1, 20 * 1024);
+
+        auto child = fork();
+        if (child == 0) {
+            /// Overflow must hit the guard page
+            static_cast<volatile char *>(second.ptr)[-1] = 1;
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    }
+
+    auto stats = pool.stats();
+    assert(stats.live == 0);
+    assert(stats.peak_live == 2);
+    assert(stats.pooled == 1);
+    assert(stats.high_water >= 20 * 1024 && stats.high_water < 64 * 1024);
+
+    /// A stack cached by an exited thread goes back to the shared pool
+    {
+        auto held = pool.alloc();
+        void *cached = nullptr;
+        std::thread([&]() {
+            auto stack = pool.alloc();
+            cached = stack.ptr;
+        }).join();
+        assert(pool.stats().pooled == 1);
+        held.free();
+        auto stack = pool.alloc();
+        assert(stack.ptr == cached);
+        assert(pool.stats().pooled == 0 && pool.stats().live == 1);
+    }
+    pool.report(std::cout);
+    std::cout << "Done" << std::endl;
+}
+
+template <class Scheduler>
+void test_shared_stack() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    using namespace std::chrono_literals;
+
+    constexpr int fibers = 16;
+    constexpr int rounds = 10;
+    int done = 0;
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    Scheduler sched;
+
+    for (int i = 0; i < fibers; ++i) {
+        sched.schedule([&, i]() {
+            /// Stack contents must survive other fibers running on the same stack
+            char pattern[1024];
+            memset(pattern, 'a' + i, sizeof(pattern));
+            for (int j = 0; j < rounds; ++j) {
+                yield();
+                for (char c : pattern) {
+                    assert(c == 'a' + i);
+                }
+            }
+            ++done;
+        }, StackMode::SHARED);
+    }
+    sched.schedule([&]() {
+        char buf[64] = {};
+        auto r = Async::read(fds[0], buf, sizeof(buf));
+        assert(r == 6 && std::string(buf) == "shared");
+        try {
+            Async::read(fds[0], buf, sizeof(buf), 5ms);
+            assert(false);
+        } catch (TimeoutError &) {
+        }
+        ++done;
+    }, StackMode::SHARED);
+    sched.schedule([&]() {
+        char msg[] = "shared";
+        Async::sleep_for(1ms);
+        auto w = Async::write(fds[1], msg, 6);
+        assert(w == 6);
+        ++done;
+    }, StackMode::SHARED);
+
+    scheduler_run(sched);
+
+    assert(done == fibers + 2);
+    close(fds[0]);
+    close(fds[1]);
+    std::cout << "Done" << std::endl;
+}
+
+void test_deferred_stacks() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr int count = 10000;
+    auto live = stack_pool.stats().live;
+    size_t peak = 0;
+    int done = 0;
+
+    EpollScheduler sched;
+    for (int i = 0; i < count; ++i) {
+        sched.schedule([&]() {
+            peak = std::max(peak, stack_pool.stats().live);
+            ++done;
+        }, i % 2 ? StackMode::SHARED : StackMode::PRIVATE);
+    }
+    /// Queued fibers hold no stack
+    assert(stack_pool.stats().live == live);
+
+    scheduler_run(sched);
+
+    assert(done == count);
+    /// One private stack of the running fiber plus the shared one
+    assert(peak <= live + 2);
+    std::cout << "Done" << std::endl;
+}
+
+void test_closure_placement() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    int sum = 0;
+    std::array<int, 256> big{};
+    std::iota(big.begin(), big.end(), 0);
+
+    /// Warm up the context free list
+    make_context();
+
+    auto before = allocations.load();
+    auto small = FiberScheduler::create_context_from_fiber([&sum]() {
+        sum += 1;
+    });
+    auto large = FiberScheduler::create_context_from_fiber([&sum, big]() {
+        sum += std::accumulate(big.begin(), big.end(), 0);
+    });
+    assert(allocations.load() == before);
+
+    EpollScheduler sched;
+    sched.schedule(std::move(small));
+    sched.schedule(std::move(large));
+    /// Move only captures, std::function could not hold them
+    sched.schedule([&sum, owned = std::make_unique<int>(7)]() {
+        yield();
+        sum += *owned;
+    });
+    sched.schedule([&sum, big]() {
+        yield();
+        sum += big.back();
+    }, StackMode::SHARED);
+    scheduler_run(sched);
+
+    assert(sum == 1 + 255 * 256 / 2 + 7 + 255);
+    std::cout << "Done" << std::endl;
+}
+
+void test_yield_no_alloc() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr int fibers = 100;
+    constexpr int rounds = 1000;
+    size_t first = 0;
+    size_t last = 0;
+
+    EpollScheduler sched;
+    for (int i = 0; i < fibers; ++i) {
+        sched.schedule([&, i]() {
+            yield();
+            /// All fibers are started by now
+            if (i == 0) {
+                first = allocations.load();
+            }
+            for (int j = 0; j < rounds; ++j) {
+                yield();
+            }
+            if (i == 0) {
+                last = allocations.load();
+            }
+        });
+    }
+    scheduler_run(sched);
+
+    assert(first != 0 && first == last);
+    std::cout << "Done" << std::endl;
+}
+
+void test_epoll_persistent() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr int rounds = 1000;
+    int first[2];
+    int second[2];
+    int received = 0;
+    int finished = 0;
+
+    EpollScheduler sched;
+    auto ping_pong = [&](int *fds) {
+        schedule([&, fds]() {
+            char buf[4];
+            for (int i = 0; i < rounds; ++i) {
+                write_all(fds[0], "ping", 4);
+                auto r = Async::read(fds[0], buf, sizeof(buf));
+                assert(r == 4 && memcmp(buf, "pong", 4) == 0);
+            }
+            ++finished;
+        });
+        schedule([&, fds]() {
+            char buf[4];
+            for (int i = 0; i < rounds; ++i) {
+                auto r = Async::read(fds[1], buf, sizeof(buf));
+                assert(r == 4 && memcmp(buf, "ping", 4) == 0);
+                write_all(fds[1], "pong", 4);
+                ++received;
+            }
+        });
+    };
+    sched.schedule([&]() {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, first) == 0);
+        ping_pong(first);
+        while (finished != 1) {
+            Async::sleep_for(std::chrono::milliseconds(1));
+        }
+        /// Registered once and switched to non-blocking
+        assert(fcntl(first[0], F_GETFL) & O_NONBLOCK);
+        Async::close(first[0]);
+        Async::close(first[1]);
+        /// Same numbers, fresh registration
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, second) == 0);
+        ping_pong(second);
+    });
+    scheduler_run(sched);
+
+    assert(received == 2 * rounds);
+    close(second[0]);
+    close(second[1]);
+
+    /// Second reader of a parked fd fails, the first one keeps waiting
+    int shared[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, shared) == 0);
+    bool rejected = false;
+    EpollScheduler shared_sched;
+    shared_sched.schedule([&]() {
+        char c;
+        assert(Async::read(shared[0], &c, 1) == 1 && c == 'x');
+    });
+    shared_sched.schedule([&]() {
+        char c;
+        try {
+            Async::read(shared[0], &c, 1);
+            assert(false);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        write_all(shared[1], "x", 1);
+    });
+    scheduler_run(shared_sched);
+
+    assert(rejected);
+    close(shared[0]);
+    close(shared[1]);
+    std::cout << "Done" << std::endl;
+}
+
+void test_inline_io() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    class CountSwitches : public Watch {
+    public:
+        explicit CountSwitches(int *switches) : switches(switches) {
+        }
+
+        void operator()(Action &, Context &) override {
+            ++*switches;
+        }
+
+    private:
+        int *switches;
+    };
+
+    constexpr int rounds = 1000;
+    int switches = 0;
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    EpollScheduler sched;
+    sched.schedule([&]() {
+        sched.create_current_fiber_watch<CountSwitches>(&switches);
+        char c;
+        for (int i = 0; i < rounds; ++i) {
+            assert(Async::write(fds[0], "x", 1) == 1);
+            assert(Async::read(fds[1], &c, 1) == 1 && c == 'x');
+        }
+    });
+    scheduler_run(sched);
+
+    /// Registration of both fds parks, then the budget forces a pass through the scheduler
+    assert(switches < 2 * rounds / 32);
+    Async::close(fds[0]);
+    Async::close(fds[1]);
+    std::cout << "Done" << std::endl;
+}
+
+void test_epoll_batch() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr int pairs = 200;
+    std::vector<std::array<int, 2>> fds(pairs);
+    for (auto &pair : fds) {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair.data()) == 0);
+    }
+    int received = 0;
+
+    EpollScheduler::Options options;
+    options.max_events = 512;
+    options.busy_poll = std::chrono::microseconds(100);
+    EpollScheduler sched(options);
+
+    for (auto &pair : fds) {
+        sched.schedule([&, fd = pair[0]]() {
+            char c;
+            assert(Async::read(fd, &c, 1) == 1);
+            ++received;
+        });
+    }
+    sched.schedule([&]() {
+        /// All readers are parked: wake them at once
+        for (auto &pair : fds) {
+            assert(write(pair[1], "x", 1) == 1);
+        }
+    });
+    scheduler_run(sched);
+
+    assert(received == pairs);
+    auto &stats = sched.stats();
+    assert(stats.max_batch == pairs);
+    assert(stats.polls > 0);
+    for (auto &pair : fds) {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    std::cout << "Done" << std::endl;
+}
+
+void test_sync() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    EpollScheduler sched;
+
+    /// Critical section survives yields
+    Mutex mutex;
+    int inside = 0;
+    int counter = 0;
+    for (int i = 0; i < 10; ++i) {
+        sched.schedule([&]() {
+            for (int j = 0; j < 10; ++j) {
+                std::lock_guard lock(mutex);
+                assert(++inside == 1);
+                yield();
+                ++counter;
+                --inside;
+            }
+        });
+    }
+
+    /// Producer and consumer on condition variable
+    ConditionVariable cv;
+    std::deque<int> queue;
+    int consumed = 0;
+    sched.schedule([&]() {
+        for (int i = 0; i < 100; ++i) {
+            std::unique_lock lock(mutex);
+            cv.wait(mutex, [&]() { return !queue.empty(); });
+            assert(queue.front() == i);
+            queue.pop_front();
+            ++consumed;
+        }
+    });
+    sched.schedule([&]() {
+        for (int i = 0; i < 100; ++i) {
+            {
+                std::lock_guard lock(mutex);
+                queue.push_back(i);
+            }
+            cv.notify_one();
+            yield();
+        }
+    });
+
+    /// At most 3 holders at once
+    Semaphore semaphore(3);
+    int holders = 0;
+    int max_holders = 0;
+    for (int i = 0; i < 10; ++i) {
+        sched.schedule([&]() {
+            semaphore.acquire();
+            max_holders = std::max(max_holders, ++holders);
+            yield();
+            --holders;
+            semaphore.release();
+        });
+    }
+
+    /// Pipeline through bounded channels with batch ops
+    Channel<int> numbers(4);
+    Channel<std::string> lines(2);
+    std::vector<std::string> output;
+    sched.schedule([&]() {
+        std::vector<int> batch(100);
+        std::iota(batch.begin(), batch.end(), 0);
+        assert(numbers.send_batch(batch.begin(), batch.end()) == batch.size());
+        numbers.close();
+    });
+    sched.schedule([&]() {
+        std::vector<int> batch;
+        while (numbers.receive_batch(std::back_inserter(batch), 8)) {
+            assert(batch.size() <= 8);
+            for (auto n : batch) {
+                assert(lines.send(std::to_string(n)));
+            }
+            batch.clear();
+        }
+        lines.close();
+    });
+    sched.schedule([&]() {
+        while (auto line = lines.receive()) {
+            output.push_back(*line);
+        }
+        assert(!lines.send("late"));
+    });
+
+    scheduler_run(sched);
+
+    assert(counter == 100);
+    assert(consumed == 100);
+    assert(max_holders == 3 && semaphore.available() == 3);
+    assert(output.size() == 100 && output.front() == "0" && output.back() == "99");
+    std::cout << "Done" << std::endl;
+}
+
+void test_splice() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    EpollScheduler sched;
+
+    /// client <-> proxy <-> echo over two socket pairs
+    int client[2], server[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, client) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, server) == 0);
+
+    constexpr size_t SIZE = 1 << 20;
+    std::string sent(SIZE, 0);
+    for (size_t i = 0; i < SIZE; ++i) {
+        sent[i] = static_cast<char>(i * 7 + i / 251);
+    }
+    std::string echoed;
+    std::pair<size_t, size_t> forwarded;
+
+    /// Caller on the shared stack: the other direction must not write to it
+    sched.schedule([&]() {
+        forwarded = Async::proxy(client[1], server[0]);
+    }, StackMode::SHARED);
+    sched.schedule([&]() {
+        char buf[4096];
+        ssize_t n;
+        while ((n = Async::read(server[1], buf, sizeof(buf))) > 0) {
+            for (ssize_t off = 0; off < n;) {
+                off += Async::write(server[1], buf + off, n - off);
+            }
+        }
+        shutdown(server[1], SHUT_WR);
+    });
+    sched.schedule([&]() {
+        schedule([&]() {
+            for (size_t off = 0; off < SIZE;) {
+                off += Async::write(client[0], sent.data() + off, SIZE - off);
+            }
+            shutdown(client[0], SHUT_WR);
+        });
+        char buf[4096];
+        ssize_t n;
+        while ((n = Async::read(client[0], buf, sizeof(buf))) > 0) {
+            echoed.append(buf, n);
+        }
+    });
+
+    /// Scatter/gather
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    std::string gathered;
+    sched.schedule([&]() {
+        char head[] = "head:";
+        char body[] = "body";
+        iovec out[] = {{head, 5}, {body, 4}};
+        assert(Async::writev(pair[0], out, 2) == 9);
+
+        char a[3], b[6];
+        iovec in[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+        assert(Async::readv(pair[1], in, 2) == 9);
+        gathered.append(a, sizeof(a)).append(b, sizeof(b));
+    });
+
+    /// Socket to pipe and back, parking on the empty socket
+    int splice_pair[2], splice_pipe[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, splice_pair) == 0);
+    assert(pipe(splice_pipe) == 0);
+    std::string spliced;
+    sched.schedule([&]() {
+        schedule([&]() {
+            Async::sleep_for(std::chrono::milliseconds(5));
+            assert(Async::write(splice_pair[0], "spliced", 7) == 7);
+        });
+        assert(Async::splice(splice_pair[1], splice_pipe[1], 64) == 7);
+        assert(Async::splice(splice_pipe[0], splice_pair[1], 64) == 7);
+        char buf[7];
+        assert(Async::read(splice_pair[0], buf, sizeof(buf)) == 7);
+        spliced.assign(buf, sizeof(buf));
+    });
+
+    /// File to socket
+    int file_pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, file_pair) == 0);
+    FILE *file = tmpfile();
+    assert(file);
+    std::string content(100000, 'f');
+    assert(fwrite(content.data(), 1, content.size(), file) == content.size());
+    assert(fflush(file) == 0);
+    size_t file_received = 0;
+    sched.schedule([&]() {
+        schedule([&]() {
+            off_t offset = 0;
+            while (offset < static_cast<off_t>(content.size())) {
+                Async::sendfile(file_pair[0], fileno(file), &offset, content.size() - offset);
+            }
+            shutdown(file_pair[0], SHUT_WR);
+        });
+        char buf[4096];
+        ssize_t n;
+        while ((n = Async::read(file_pair[1], buf, sizeof(buf))) > 0) {
+            assert(std::all_of(buf, buf + n, [](char c) { return c == 'f'; }));
+            file_received += n;
+        }
+    });
+
+    scheduler_run(sched);
+
+    assert(echoed == sent);
+    assert(forwarded.first == SIZE && forwarded.second == SIZE);
+    assert(gathered == "head:body");
+    assert(spliced == "spliced");
+    assert(file_received == content.size());
+
+    /// Cancelled proxy joins its other direction and closes its pipes
+    int idle_a[2], idle_b[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, idle_a) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, idle_b) == 0);
+    auto lowest_free_fd = []() {
+        int fd = dup(0);
+        close(fd);
+        return fd;
+    };
+    EpollScheduler cancel_sched;
+    int free_fd = lowest_free_fd();
+    bool proxy_cancelled = false;
+    cancel_sched.schedule([&]() {
+        {
+            Nursery nursery;
+            nursery.spawn([&]() {
+                try {
+                    Async::proxy(idle_a[1], idle_b[0]);
+                } catch (const Cancelled &) {
+                    proxy_cancelled = true;
+                    throw;
+                }
+            });
+            yield();
+            yield();
+            assert(lowest_free_fd() != free_fd);
+        }
+        assert(proxy_cancelled);
+        assert(lowest_free_fd() == free_fd);
+    });
+    scheduler_run(cancel_sched);
+
+    for (int fd : {client[0], client[1], server[0], server[1], pair[0], pair[1], file_pair[0], file_pair[1],
+                   splice_pair[0], splice_pair[1], splice_pipe[0], splice_pipe[1],
+                   idle_a[0], idle_a[1], idle_b[0], idle_b[1]}) {
+        close(fd);
+    }
+    fclose(file);
+    std::cout << "Done" << std::endl;
+}
+
+void test_buffered() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    /// Every length and offset against memchr, vector bodies and tails
+    std::string hay(300, 'a');
+    for (size_t pos = 0; pos != hay.size(); ++pos) {
+        hay[pos] = '\n';
+        for (size_t from = 0; from <= pos; from += 7) {
+            for (size_t size : {pos - from, pos - from + 1, hay.size() - from}) {
+                auto *expected = static_cast<const char *>(memchr(hay.data() + from, '\n', size));
+                assert(Async::find_delimiter(hay.data() + from, size, '\n') == expected);
+            }
+        }
+        hay[pos] = 'a';
+    }
+
+    EpollScheduler sched;
+
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+
+    std::vector<std::string> lines;
+    for (size_t i = 0; i != 2000; ++i) {
+        lines.push_back(std::string(i * 37 % 300, static_cast<char>('a' + i % 26)));
+    }
+    lines.push_back(std::string(3000, 'x'));
+    std::string blob(100000, 0);
+    for (size_t i = 0; i != blob.size(); ++i) {
+        blob[i] = static_cast<char>(i % 251);
+    }
+
+    sched.schedule([&]() {
+        Async::BufferedWriter writer(pair[0], 4096);
+        for (auto &line : lines) {
+            writer.write(line);
+            writer.write("\n");
+        }
+        writer.write(blob);
+        writer.write("tail");
+        writer.flush();
+        assert(writer.buffered() == 0);
+        shutdown(pair[0], SHUT_WR);
+    });
+
+    size_t matched = 0;
+    std::string received_blob(blob.size(), 0);
+    std::string tail;
+    sched.schedule([&]() {
+        Async::BufferedReader reader(pair[1], 4096);
+        for (auto &line : lines) {
+            auto got = reader.read_line();
+            assert(got && *got == line);
+            ++matched;
+        }
+        assert(reader.read_exact(received_blob.data(), blob.size()) == blob.size());
+        auto rest = reader.read_until('\n');
+        assert(rest);
+        tail = *rest;
+        assert(!reader.read_line());
+
+        /// Line longer than the buffer
+        int long_pair[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, long_pair) == 0);
+        std::string huge(200, 'y');
+        write_all(long_pair[0], huge.data(), huge.size());
+        Async::BufferedReader small(long_pair[1], 64);
+        try {
+            small.read_line();
+            assert(false);
+        } catch (std::length_error &) {
+        }
+        Async::close(long_pair[0]);
+        Async::close(long_pair[1]);
+    });
+
+    scheduler_run(sched);
+
+    assert(matched == lines.size());
+    assert(received_blob == blob);
+    assert(tail == "tail");
+    close(pair[0]);
+    close(pair[1]);
+    std::cout << "Done" << std::endl;
+}
+
+template <class Scheduler>
+void test_connect() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    constexpr short port = 8092;
+    auto closed_port = closed_loopback_port();
+
+    Scheduler sched;
+
+    int accepted = 0;
+    int sock = prepare_listen_sock(port);
+    sched.schedule([&]() {
+        /// Answers "ping" with "pong", hangs up on "bye"
+        while (true) {
+            auto client = Async::accept(sock, nullptr, nullptr);
+            ++accepted;
+            schedule([client]() {
+                char buf[4];
+                while (Async::read(client, buf, sizeof(buf)) == sizeof(buf)) {
+                    if (std::string(buf, sizeof(buf)) == "bye!") {
+                        break;
+                    }
+                    write_all(client, "pong", 4);
+                }
+                Async::close(client);
+            });
+            if (accepted == 3) {
+                break;
+            }
+        }
+        Async::close(sock);
+    });
+
+    sched.schedule([&]() {
+        auto refused = loopback(closed_port);
+        try {
+            Async::connect((sockaddr*)&refused, sizeof(refused));
+            assert(false);
+        } catch (std::system_error &e) {
+            assert(e.code().value() == ECONNREFUSED);
+        }
+
+        Async::ConnectionPool pool;
+        auto addr = loopback(port);
+        auto ping = [&](Async::Connection &connection) {
+            write_all(connection.fd(), "ping", 4);
+            char buf[4];
+            assert(Async::read(connection.fd(), buf, sizeof(buf)) == 4);
+            assert(std::string(buf, sizeof(buf)) == "pong");
+        };
+
+        /// Released connection is reused
+        auto first = pool.acquire((sockaddr*)&addr, sizeof(addr));
+        ping(first);
+        auto fd = first.fd();
+        first.release();
+        assert(pool.idle() == 1);
+        auto again = pool.acquire((sockaddr*)&addr, sizeof(addr));
+        assert(again.fd() == fd && pool.connects() == 1);
+
+        /// Concurrent users get separate sockets
+        auto second = pool.acquire((sockaddr*)&addr, sizeof(addr));
+        assert(second.fd() != fd && pool.connects() == 2);
+        ping(again);
+        ping(second);
+
+        /// Connection hung up by peer is not handed out
+        write_all(second.fd(), "bye!", 4);
+        char byte;
+        assert(Async::read(second.fd(), &byte, 1) == 0);
+        second.release();
+        again.release();
+        assert(pool.idle() == 2);
+        auto live = pool.acquire((sockaddr*)&addr, sizeof(addr));
+        assert(live.fd() == fd);
+        auto fresh = pool.acquire((sockaddr*)&addr, sizeof(addr));
+        assert(pool.connects() == 3 && pool.idle() == 0);
+        ping(live);
+        ping(fresh);
+
+        /// Padding bytes of the address do not split the pool
+        auto fresh_fd = fresh.fd();
+        fresh.release();
+        auto padded = addr;
+        memset(padded.sin_zero, 0xff, sizeof(padded.sin_zero));
+        auto same = pool.acquire((sockaddr*)&padded, sizeof(padded));
+        assert(same.fd() == fresh_fd && pool.connects() == 3);
+        ping(same);
+    });
+
+    scheduler_run(sched);
+
+    assert(accepted == 3);
+    std::cout << "Done" << std::endl;
+}
+
+void test_profiling() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    Histogram histogram;
+    for (uint64_t value = 0; value != 100000; ++value) {
+        assert(Histogram::lower_bound(Histogram::index(value)) <= value);
+        assert(Histogram::lower_bound(Histogram::index(value) + 1) > value);
+        histogram.record(value);
+    }
+    auto p50 = histogram.percentile(0.5);
+    assert(p50 <= 50000 && p50 >= 50000 * 7 / 8);
+    assert(histogram.percentile(1) <= histogram.max() && histogram.max() == 99999);
+
+    Profiler profiler;
+    EpollScheduler sched;
+
+    volatile uint64_t sink = 0;
+    for (int i = 0; i != 3; ++i) {
+        sched.schedule([&]() {
+            profiler.attach("cpu");
+            for (int slice = 0; slice != 50; ++slice) {
+                for (int j = 0; j != 100000; ++j) {
+                    sink = sink + j;
+                }
+                yield();
+            }
+        });
+    }
+    for (int i = 0; i != 2; ++i) {
+        sched.schedule([&]() {
+            profiler.attach("io");
+            char deep[32 * 1024];
+            memset(deep, 1, sizeof(deep));
+            for (int j = 0; j != 5; ++j) {
+                Async::sleep_for(std::chrono::milliseconds(2));
+            }
+            sink = sink + deep[100];
+        });
+    }
+
+    scheduler_run(sched);
+
+    auto cpu = profiler.profile("cpu");
+    auto io = profiler.profile("io");
+    assert(cpu.fibers == 3 && cpu.slices == 3 * 51);
+    assert(io.fibers == 2 && io.slices == 2 * 6);
+    assert(cpu.slice.count() == cpu.slices && cpu.parked.count() == 0);
+    assert(cpu.runnable.count() == 3 * 50 && cpu.runnable_cycles > 0);
+    assert(io.parked.count() == 2 * 5);
+    assert(cpu.cpu_cycles > io.cpu_cycles);
+    /// Each io fiber sleeps at least 10ms in total
+    assert(io.parked_cycles * Profiler::ns_per_cycle() >= 2 * 10e6 * 0.9);
+    assert(io.stack_high_water >= 32 * 1024);
+    assert(io.stack_high_water <= StackPool::STACK_SIZE);
+
+    /// Depth is the fiber's own, not left by an earlier user of its pooled stack
+    EpollScheduler reuse_sched;
+    reuse_sched.schedule([&]() {
+        profiler.attach("deep");
+        char deep[64 * 1024];
+        memset(deep, 1, sizeof(deep));
+        sink = sink + deep[100];
+    });
+    reuse_sched.schedule([&]() {
+        profiler.attach("shallow");
+        yield();
+    });
+    scheduler_run(reuse_sched);
+    assert(profiler.profile("deep").stack_high_water >= 64 * 1024);
+    assert(profiler.profile("shallow").stack_high_water < 32 * 1024);
+
+    std::ostringstream report;
+    profiler.report(report);
+    assert(report.str().find("cpu: fibers 3") != std::string::npos);
+    assert(report.str().find("io: fibers 2") != std::string::npos);
+    std::cout << "Done" << std::endl;
+}
+
+void test_tracing() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    Tracing::drain();
+
+    /// Lifecycle of one fiber recorded by hand: queued, running, parked, queued, running
+    int fiber;
+    Tracing::record(Tracing::Type::SPAWN, &fiber);
+    Tracing::record(Tracing::Type::SWITCH_IN, &fiber);
+    Tracing::record(Tracing::Type::PARK, &fiber, 7);
+    Tracing::record(Tracing::Type::SWITCH_OUT, &fiber, Action::WAIT);
+    Tracing::record(Tracing::Type::WAKE, &fiber);
+    Tracing::record(Tracing::Type::SWITCH_IN, &fiber);
+    Tracing::record(Tracing::Type::SWITCH_OUT, &fiber, Action::STOP);
+
+    auto events = Tracing::drain();
+    assert(events.size() == 7);
+    assert(std::is_sorted(events.begin(), events.end(), [](auto &a, auto &b) { return a.tsc < b.tsc; }));
+    assert(events[2].type == Tracing::Type::PARK && events[2].arg == 7);
+    assert(Tracing::drain().empty());
+
+    std::ostringstream chrome;
+    Tracing::write_chrome(events, chrome);
+    auto json = chrome.str();
+    auto count = [&](const std::string &what) {
+        size_t n = 0;
+        for (auto pos = json.find(what); pos != std::string::npos; pos = json.find(what, pos + 1)) {
+            ++n;
+        }
+        return n;
+    };
+    assert(count(R"("name":"running")") == 2);
+    assert(count(R"("name":"queued")") == 2);
+    assert(count(R"("name":"parked")") == 1);
+    assert(count(R"("fd":7)") == 1);
+
+    std::stringstream binary;
+    Tracing::write_binary(events, binary);
+    double rate = 0;
+    auto loaded = Tracing::read_binary(binary, &rate);
+    assert(rate == Profiler::ns_per_cycle());
+    assert(loaded.size() == events.size());
+    assert(memcmp(loaded.data(), events.data(), events.size() * sizeof(Tracing::Event)) == 0);
+
+#ifdef FIBERS_TRACING
+    EpollScheduler sched;
+    const void *traced = nullptr;
+    sched.schedule([&]() {
+        traced = &FiberScheduler::current();
+        yield();
+        Async::sleep_for(std::chrono::milliseconds(1));
+    });
+    scheduler_run(sched);
+
+    std::vector<Tracing::Type> types;
+    for (auto &event : Tracing::drain()) {
+        if (event.fiber == reinterpret_cast<uintptr_t>(traced)) {
+            types.push_back(event.type);
+        }
+    }
+    using T = Tracing::Type;
+    assert((types == std::vector<T>{T::SPAWN, T::WAKE, T::SWITCH_IN, T::SWITCH_OUT, T::WAKE, T::SWITCH_IN,
+                                    T::SWITCH_OUT, T::PARK, T::WAKE, T::SWITCH_IN, T::SWITCH_OUT}));
+#endif
+    std::cout << "Done" << std::endl;
+}
+
+void test_priorities() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    /// Classes share a saturated scheduler 16:4:1, low still progresses
+    {
+        EpollScheduler sched;
+        std::vector<Priority> finished;
+        int low_slices_before_high_done = 0;
+        int high_left = 20;
+        for (auto priority : {Priority::LOW, Priority::NORMAL, Priority::HIGH}) {
+            for (int i = 0; i != 20; ++i) {
+                sched.schedule([&, priority]() {
+                    for (int j = 0; j != 20; ++j) {
+                        if (priority == Priority::LOW && high_left) {
+                            ++low_slices_before_high_done;
+                        }
+                        yield();
+                    }
+                    finished.push_back(priority);
+                    if (priority == Priority::HIGH) {
+                        --high_left;
+                    }
+                }, priority);
+            }
+        }
+        scheduler_run(sched);
+        std::array<double, 3> mean_rank{};
+        for (size_t rank = 0; rank != finished.size(); ++rank) {
+            mean_rank[static_cast<size_t>(finished[rank])] += rank / 20.0;
+        }
+        assert(mean_rank[0] < mean_rank[1] && mean_rank[1] < mean_rank[2]);
+        assert(low_slices_before_high_done > 0);
+    }
+
+    /// Earliest deadline first, before the classes
+    {
+        EpollScheduler sched;
+        std::vector<int> order;
+        auto now = std::chrono::steady_clock::now();
+        sched.schedule([&]() { order.push_back(0); }, Priority::HIGH);
+        for (int i = 3; i != 0; --i) {
+            sched.schedule([&, i]() { order.push_back(i); }, now + std::chrono::milliseconds(i));
+        }
+        scheduler_run(sched);
+        assert((order == std::vector<int>{1, 2, 3, 0}));
+    }
+
+    /// Aging: busy deadline fibers do not starve a low one
+    {
+        EpollScheduler sched;
+        int dispatches = 0;
+        int low_ran_at = -1;
+        for (int i = 0; i != 4; ++i) {
+            sched.schedule([&]() {
+                for (int j = 0; j != 2000 && low_ran_at < 0; ++j) {
+                    ++dispatches;
+                    yield();
+                }
+            }, std::chrono::steady_clock::now());
+        }
+        sched.schedule([&]() {
+            low_ran_at = dispatches;
+        }, Priority::LOW);
+        scheduler_run(sched);
+        assert(low_ran_at >= 0 && low_ran_at <= FiberScheduler::AGING_DISPATCHES + 8);
+    }
+    std::cout << "Done" << std::endl;
+}
+
+struct Tracked {
+    static inline int alive = 0;
+    static inline int constructed = 0;
+    int value = 0;
+
+    Tracked() {
+        ++alive;
+        ++constructed;
+    }
+
+    explicit Tracked(int value) : Tracked() {
+        this->value = value;
+    }
+
+    ~Tracked() {
+        --alive;
+    }
+};
+
+FiberLocal<std::string> request_id;
+FiberLocal<Tracked> tracked;
+/// Kept in the slot itself, and too big for the context arena
+FiberLocal<int> attempt;
+FiberLocal<std::array<char, 300>> scratch;
+
+void test_fiber_local() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    EpollScheduler sched;
+
+    std::vector<std::string> seen;
+    for (int i = 0; i != 10; ++i) {
+        sched.schedule([&, i]() {
+            assert(!request_id.has_value());
+            *request_id = "request-" + std::to_string(i);
+            for (int j = 0; j != 5; ++j) {
+                yield();
+                assert(*request_id == "request-" + std::to_string(i));
+            }
+            if (i % 2) {
+                tracked.emplace(i);
+                yield();
+                assert(tracked->value == i);
+            }
+            seen.push_back(*request_id);
+        });
+    }
+    /// Untouched locals are never constructed
+    sched.schedule([&]() {
+        yield();
+        assert(!tracked.has_value());
+    });
+    /// Destroyed when fiber ends, before the scheduler is done
+    sched.schedule([&]() {
+        while (Tracked::constructed != 5) {
+            yield();
+        }
+        while (Tracked::alive) {
+            yield();
+        }
+    });
+
+    scheduler_run(sched);
+
+    assert(seen.size() == 10);
+    assert(Tracked::constructed == 5 && Tracked::alive == 0);
+
+    /// Values follow fibers migrating between threads
+    WorkStealingScheduler stealing(4);
+    std::atomic<int> checked = 0;
+    for (int i = 0; i != 20; ++i) {
+        stealing.schedule([&, i]() {
+            assert(*attempt == 0);
+            *attempt = i;
+            scratch->fill(static_cast<char>(i));
+            for (int j = 0; j != 100; ++j) {
+                yield();
+                assert(*attempt == i && (*scratch)[299] == static_cast<char>(i));
+            }
+            ++checked;
+        });
+    }
+    stealing.run();
+    assert(checked == 20);
+    std::cout << "Done" << std::endl;
+}
+
+template <class Scheduler>
+void test_cancel() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    Scheduler sched;
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    struct Unwind {
+        size_t &count;
+
+        ~Unwind() {
+            ++count;
+        }
+    };
+
+    size_t unwound = 0;
+    Mutex held;
+    Mutex mutex;
+    ConditionVariable cv;
+    Semaphore semaphore;
+    bool shielded_done = false;
+
+    sched.schedule([&]() {
+        /// Scope exit cancels children parked in io, timer and sync waits
+        {
+            Nursery nursery;
+            held.lock();
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                char c;
+                Async::read(fds[0], &c, 1);
+                assert(false);
+            });
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                Async::sleep_for(std::chrono::hours(1));
+                assert(false);
+            });
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                semaphore.acquire();
+                assert(false);
+            });
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                held.lock();
+                assert(false);
+            });
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                mutex.lock();
+                try {
+                    cv.wait(mutex, []() { return false; });
+                } catch (const Cancelled &) {
+                    /// Relocked for the caller
+                    assert(!mutex.try_lock());
+                    mutex.unlock();
+                    throw;
+                }
+            });
+            nursery.spawn([&]() {
+                Unwind unwind{unwound};
+                while (true) {
+                    yield();
+                }
+            });
+            /// Finishes its cleanup sleep despite cancellation
+            nursery.spawn([&]() {
+                CancelShield shield;
+                Async::sleep_for(std::chrono::milliseconds(10));
+                shielded_done = true;
+            });
+            yield();
+            yield();
+            assert(nursery.size() == 7);
+        }
+        held.unlock();
+        assert(unwound == 6);
+        assert(shielded_done);
+
+        /// Fd is usable again after cancelled read
+        assert(write(fds[1], "x", 1) == 1);
+        char c;
+        assert(Async::read(fds[0], &c, 1) == 1 && c == 'x');
+
+        /// First error cancels siblings and is rethrown by join
+        Nursery nursery;
+        nursery.spawn([&]() {
+            Unwind unwind{unwound};
+            Async::sleep_for(std::chrono::hours(1));
+        });
+        nursery.spawn([&]() {
+            yield();
+            throw std::runtime_error("child failed");
+        });
+        try {
+            nursery.join();
+            assert(false);
+        } catch (const std::runtime_error &e) {
+            assert(std::string(e.what()) == "child failed");
+        }
+        assert(unwound == 7 && nursery.size() == 0);
+
+        /// Plain token, fiber ends normally with Cancelled
+        CancelToken token;
+        schedule([&]() {
+            token.attach();
+            Unwind unwind{unwound};
+            Async::sleep_for(std::chrono::hours(1));
+        });
+        yield();
+        token.cancel();
+        assert(token.cancelled());
+        yield();
+        assert(unwound == 8);
+    });
+
+    /// Parent on the shared stack while another fiber runs on it
+    int shared_children = 0;
+    bool shared_joined = false;
+    sched.schedule([&]() {
+        Nursery nursery;
+        for (int i = 0; i != 2; ++i) {
+            nursery.spawn([&]() {
+                yield();
+                ++shared_children;
+            }, StackMode::SHARED);
+        }
+        nursery.join();
+        shared_joined = true;
+    }, StackMode::SHARED);
+    sched.schedule([]() {
+        char scratch[4096];
+        memset(scratch, 0xff, sizeof(scratch));
+        yield();
+        asm volatile("" : : "r"(scratch) : "memory");
+    }, StackMode::SHARED);
+
+    scheduler_run(sched);
+
+    assert(shared_children == 2 && shared_joined);
+    close(fds[0]);
+    close(fds[1]);
+    std::cout << "Done" << std::endl;
+}
+
+void test_join() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    EpollScheduler sched;
+    bool checked = false;
+
+    sched.schedule([&]() {
+        auto answer = spawn([]() {
+            Async::sleep_for(std::chrono::milliseconds(5));
+            return 42;
+        });
+        auto nothing = spawn([]() {
+            yield();
+        });
+        auto failing = spawn([]() -> std::string {
+            yield();
+            throw std::runtime_error("backend failed");
+        });
+        assert(!answer.done());
+        assert(answer.get() == 42);
+        nothing.get();
+        try {
+            failing.get();
+            assert(false);
+        } catch (const std::runtime_error &e) {
+            assert(std::string(e.what()) == "backend failed");
+        }
+        /// Ended fiber rethrows on later calls too
+        try {
+            failing.get();
+            assert(false);
+        } catch (const std::runtime_error &) {
+        }
+
+        /// Scatter-gather, results in order of handles
+        std::vector<JoinHandle<int>> handles;
+        for (int i = 0; i != 10; ++i) {
+            handles.push_back(spawn([i]() {
+                Async::sleep_for(std::chrono::milliseconds(10 - i));
+                return i * i;
+            }));
+        }
+        auto squares = when_all(handles);
+        for (int i = 0; i != 10; ++i) {
+            assert(squares[i] == i * i);
+        }
+
+        /// Hedged request: first reply wins, the slow ones are cancelled
+        CancelToken hedge;
+        std::vector<JoinHandle<int>> replicas;
+        for (int delay : {200, 5, 100}) {
+            replicas.push_back(spawn([&hedge, delay]() {
+                hedge.attach();
+                Async::sleep_for(std::chrono::milliseconds(delay));
+                return delay;
+            }));
+        }
+        auto start = Async::Clock::now();
+        auto first = when_any(replicas);
+        assert(first == 1 && replicas[first].get() == 5);
+        hedge.cancel();
+        replicas[0].wait();
+        replicas[2].wait();
+        assert(Async::Clock::now() - start < std::chrono::milliseconds(100));
+        try {
+            replicas[0].get();
+            assert(false);
+        } catch (const Cancelled &) {
+        }
+
+        /// Detached fiber still runs to the end
+        spawn([&]() {
+            yield();
+            checked = true;
+        });
+    });
+
+    /// Caller on the shared stack while another fiber runs on it
+    std::vector<int> shared_results;
+    sched.schedule([&]() {
+        std::vector<JoinHandle<int>> handles;
+        for (int i = 0; i != 2; ++i) {
+            handles.push_back(spawn([i]() {
+                yield();
+                return i;
+            }, StackMode::SHARED));
+        }
+        shared_results = when_all(handles);
+    }, StackMode::SHARED);
+    sched.schedule([]() {
+        char scratch[4096];
+        memset(scratch, 0xff, sizeof(scratch));
+        yield();
+        asm volatile("" : : "r"(scratch) : "memory");
+    }, StackMode::SHARED);
+
+    scheduler_run(sched);
+
+    assert(checked);
+    assert((shared_results == std::vector<int>{0, 1}));
+    std::cout << "Done" << std::endl;
+}
+
+Async::Task<size_t> echo_task(int fd) {
+    char buf[256];
+    size_t total = 0;
+    ssize_t r;
+    while ((r = co_await Async::async_read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < r;) {
+            off += co_await Async::async_write(fd, buf + off, r - off);
+        }
+        total += r;
+    }
+    co_return total;
+}
+
+Async::Task<int> failing_task() {
+    co_await Async::async_yield();
+    throw std::runtime_error("task failed");
+}
+
+Async::Task<void> echo_server_task(int fd, size_t *echoed) {
+    *echoed = co_await echo_task(fd);
+    try {
+        co_await failing_task();
+        assert(false);
+    } catch (const std::runtime_error &e) {
+        assert(std::string(e.what()) == "task failed");
+    }
+    auto start = Async::Clock::now();
+    co_await Async::async_sleep_for(std::chrono::milliseconds(5));
+    assert(Async::Clock::now() - start >= std::chrono::milliseconds(5));
+    Async::close(fd);
+}
+
+Async::Task<void> counting_task(size_t *count) {
+    for (int i = 0; i != 3; ++i) {
+        co_await Async::async_yield();
+        ++*count;
+    }
+}
+
+Async::Task<void> cancellable_task(int fd, CancelToken token, bool *unwound) {
+    token.attach();
+    struct Flag {
+        bool *flag;
+
+        ~Flag() {
+            *flag = true;
+        }
+    } flag{unwound};
+    char c;
+    co_await Async::async_read(fd, &c, 1);
+    assert(false);
+}
+
+/// Parks in a child task on fd, never resumed
+Async::Task<void> parked_child(int fd, int *destroyed) {
+    struct Count {
+        int *count;
+
+        ~Count() {
+            ++*count;
+        }
+    } count{destroyed};
+    char c;
+    co_await Async::async_read(fd, &c, 1);
+    assert(false);
+}
+
+Async::Task<void> parked_task(int fd, int *destroyed) {
+    struct Count {
+        int *count;
+
+        ~Count() {
+            ++*count;
+        }
+    } count{destroyed};
+    co_await parked_child(fd, destroyed);
+    assert(false);
+}
+
+template <class Scheduler>
+void test_tasks() {
+    std::cout << __FUNCTION__ << std::endl;
+
+    /// Frames of a size class are reused
+    auto *frame = Async::FramePool::allocate(100);
+    Async::FramePool::deallocate(frame, 100);
+    assert(Async::FramePool::allocate(120) == frame);
+    Async::FramePool::deallocate(frame, 120);
+
+    Scheduler sched;
+    int fds[2];
+    int idle[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, idle) == 0);
+
+    size_t echoed = 0;
+    size_t count = 0;
+    bool unwound = false;
+    CancelToken token;
+    Async::start(sched, echo_server_task(fds[0], &echoed));
+    for (int i = 0; i != 1000; ++i) {
+        Async::start(sched, counting_task(&count));
+    }
+    Async::start(sched, cancellable_task(idle[0], token, &unwound));
+
+    /// Fibers and tasks share the scheduler
+    sched.schedule([&]() {
+        std::string message(10000, 'x');
+        for (size_t off = 0; off < message.size();) {
+            off += Async::write(fds[1], message.data() + off, message.size() - off);
+        }
+        shutdown(fds[1], SHUT_WR);
+        std::string reply(message.size(), '\0');
+        for (size_t off = 0; off < reply.size();) {
+            auto r = Async::read(fds[1], reply.data() + off, reply.size() - off);
+            assert(r > 0);
+            off += r;
+        }
+        assert(reply == message);
+        token.cancel();
+    });
+
+    scheduler_run(sched);
+
+    assert(echoed == 10000);
+    assert(count == 3000);
+    assert(unwound);
+
+    /// Frames of a task left parked are freed with its scheduler
+    int destroyed = 0;
+    {
+        Scheduler doomed;
+        Async::start(doomed, parked_task(idle[0], &destroyed));
+        doomed.schedule([]() {
+            throw std::runtime_error("stop");
+        });
+        try {
+            scheduler_run(doomed);
+            assert(false);
+        } catch (std::runtime_error &) {
+        }
+        assert(destroyed == 0);
+    }
+    assert(destroyed == 2);
+
+    Async::close(fds[1]);
+    Async::close(idle[0]);
+    Async::close(idle[1]);
+    std::cout << "Done" << std::endl;
+}
+
 int main() {
     test_simple();
     test_multiple();
@@ -548,4 +2291,34 @@ int main() {
     test_server_many_clients();
     test_server_many_clients2();
     test_supertest();
+    test_work_stealing();
+    test_thread_per_core();
+    test_server_many_clients<IoUringScheduler>();
+    test_supertest<IoUringScheduler>();
+    test_io_uring_fixed();
+    test_timers<EpollScheduler>();
+    test_timers<IoUringScheduler>();
+    test_stack_pool();
+    test_shared_stack<EpollScheduler>();
+    test_shared_stack<IoUringScheduler>();
+    test_deferred_stacks();
+    test_closure_placement();
+    test_yield_no_alloc();
+    test_epoll_persistent();
+    test_inline_io();
+    test_epoll_batch();
+    test_sync();
+    test_splice();
+    test_buffered();
+    test_connect<EpollScheduler>();
+    test_connect<IoUringScheduler>();
+    test_profiling();
+    test_tracing();
+    test_priorities();
+    test_fiber_local();
+    test_cancel<EpollScheduler>();
+    test_cancel<IoUringScheduler>();
+    test_join();
+    test_tasks<EpollScheduler>();
+    test_tasks<IoUringScheduler>();
 }
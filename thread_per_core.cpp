@@ -0,0 +1,86 @@
+#include "runtime.hpp"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <mutex>
+#include <system_error>
+
+ThreadPerCore::ThreadPerCore(size_t cores) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        throw std::system_error(errno, std::generic_category(), "sched_getaffinity");
+    }
+    std::vector<int> available;
+    for (int cpu = 0; cpu != CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            available.push_back(cpu);
+        }
+    }
+    if (cores == 0) {
+        cores = available.size();
+    }
+    for (size_t i = 0; i != cores; ++i) {
+        cpus.push_back(available[i % available.size()]);
+    }
+}
+
+void ThreadPerCore::run(const CoreMain &main) {
+    std::mutex mutex;
+    std::exception_ptr exception;
+
+    auto core = [&](size_t index) {
+        try {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[index], &set);
+            auto err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (err != 0) {
+                throw std::system_error(err, std::generic_category(), "pthread_setaffinity_np");
+            }
+            EpollScheduler sched;
+            sched.schedule([&main, index]() {
+                main(index);
+            });
+            scheduler_run(sched);
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            if (!exception) {
+                exception = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i != cpus.size(); ++i) {
+        threads.emplace_back(core, i);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+int listen_reuseport(uint16_t port, int backlog) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+    int optval = 1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0 ||
+        bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(sock, backlog) != 0) {
+        auto err = errno;
+        close(sock);
+        throw std::system_error(err, std::generic_category(), "listen_reuseport");
+    }
+    return sock;
+}
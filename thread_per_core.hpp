@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <thread>
+
+#include "epoll.hpp"
+
+/// Shared-nothing mode: one EpollScheduler per core, each on its own thread
+/// pinned to that core. Cores communicate only through the kernel, e.g. by
+/// SO_REUSEPORT listening sockets bound to the same port.
+class ThreadPerCore {
+public:
+    /// Started as the first fiber of every core
+    using CoreMain = std::function<void(size_t core)>;
+
+    /// Defaults to one core per CPU allowed for the process
+    explicit ThreadPerCore(size_t cores = 0);
+
+    size_t cores_count() const {
+        return cpus.size();
+    }
+
+    /// Run main on every core till all schedulers are empty, rethrows first exception
+    void run(const CoreMain &main);
+
+private:
+    std::vector<int> cpus;
+};
+
+/// Non-blocking SO_REUSEPORT listening socket, kernel shards incoming
+/// connections between all sockets bound to the port
+int listen_reuseport(uint16_t port, int backlog = SOMAXCONN);
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+/// Hierarchical timing wheel with 1ms ticks. Six levels of 64 slots cover
+/// 2^36 ms, later deadlines are clamped to the last level and re-cascaded.
+/// Timers are intrusive, so arm and disarm are O(1) list operations.
+class TimingWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum {
+        LEVELS = 6,
+        SLOT_BITS = 6,
+        SLOTS = 1 << SLOT_BITS,
+        SLOT_MASK = SLOTS - 1,
+    };
+
+    struct Timer {
+        /// Called with timer already disarmed
+        using Expire = void (*)(Timer &timer, void *owner);
+
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        uint64_t expires = 0;
+        Expire expire = nullptr;
+
+        Timer() = default;
+
+        explicit Timer(Expire expire) : expire(expire) {
+        }
+
+        /// Links are never copied: a moved timer is disarmed
+        Timer(const Timer &other) : expire(other.expire) {
+        }
+
+        Timer &operator=(const Timer &other) {
+            expire = other.expire;
+            return *this;
+        }
+
+        bool armed() const {
+            return next != nullptr;
+        }
+    };
+
+    explicit TimingWheel(Clock::time_point start = Clock::now()) : start(start) {
+        for (auto &level : slots) {
+            for (auto &slot : level) {
+                slot.prev = slot.next = &slot;
+            }
+        }
+    }
+
+    TimingWheel(const TimingWheel &other) = delete;
+    void operator=(const TimingWheel &other) = delete;
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    void arm(Timer &timer, Clock::time_point deadline) {
+        disarm(timer);
+        timer.expires = to_tick(deadline);
+        insert(timer);
+        ++count;
+    }
+
+    void disarm(Timer &timer) {
+        if (!timer.armed()) {
+            return;
+        }
+        unlink(timer);
+        --count;
+    }
+
+    /// Fire all timers with deadline not after now
+    void advance(Clock::time_point now, void *owner) {
+        /// Deadlines are rounded up to a tick and now down, never fire early
+        auto target = passed_ticks(now);
+        while (current <= target) {
+            if (count == 0) {
+                current = target + 1;
+                break;
+            }
+            auto index = current & SLOT_MASK;
+            if (index == 0) {
+                cascade();
+            }
+            auto &slot = slots[0][index];
+            /// Callbacks may arm timers into this very slot, they are expired too
+            while (slot.next != &slot) {
+                auto &timer = *slot.next;
+                unlink(timer);
+                --count;
+                timer.expire(timer, owner);
+            }
+            ++current;
+            auto next_index = current & SLOT_MASK;
+            if (next_index != 0 && current <= target) {
+                /// Skip empty slots up to the next occupied one or the level boundary
+                auto pending = occupied[0] >> next_index;
+                uint64_t skip = pending ? __builtin_ctzll(pending) : SLOTS - next_index;
+                current = std::min(current + skip, target + 1);
+            }
+        }
+    }
+
+    /// Milliseconds till the nearest deadline (a lower bound), -1 if no timers
+    int timeout(Clock::time_point now) const {
+        if (count == 0) {
+            return -1;
+        }
+        auto now_tick = passed_ticks(now);
+        auto nearest = UINT64_MAX;
+        auto index = current & SLOT_MASK;
+        if (auto pending = occupied[0] >> index) {
+            nearest = current + __builtin_ctzll(pending);
+        } else if (occupied[0]) {
+            nearest = (current | SLOT_MASK) + 1;
+        }
+        for (int level = 1; level != LEVELS; ++level) {
+            if (!occupied[level]) {
+                continue;
+            }
+            auto shift = level * SLOT_BITS;
+            auto level_index = (current >> shift) & SLOT_MASK;
+            /// Slots are processed at the start of their range, an occupied
+            /// slot at the current index belongs to the next round
+            auto rotated = level_index ? (occupied[level] >> level_index) | (occupied[level] << (SLOTS - level_index))
+                                       : occupied[level];
+            uint64_t distance = (rotated & ~uint64_t(1)) ? __builtin_ctzll(rotated & ~uint64_t(1)) : SLOTS;
+            nearest = std::min(nearest, ((current >> shift) + distance) << shift);
+        }
+        if (nearest <= now_tick) {
+            return 0;
+        }
+        return static_cast<int>(std::min<uint64_t>(nearest - now_tick, INT_MAX));
+    }
+
+private:
+    uint64_t to_tick(Clock::time_point time) const {
+        if (time <= start) {
+            return 0;
+        }
+        if (time == Clock::time_point::max()) {
+            return UINT64_MAX;
+        }
+        /// Round up: a timer never fires before its deadline
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(time - start).count();
+        return static_cast<uint64_t>(ms);
+    }
+
+    /// Number of whole ticks from start till time
+    uint64_t passed_ticks(Clock::time_point time) const {
+        if (time <= start) {
+            return 0;
+        }
+        return static_cast<uint64_t>(std::chrono::floor<std::chrono::milliseconds>(time - start).count());
+    }
+
+    void insert(Timer &timer) {
+        auto expires = std::max(timer.expires, current);
+        auto delta = expires - current;
+        int level = 0;
+        while (level + 1 != LEVELS && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) {
+            ++level;
+        }
+        if (level + 1 == LEVELS && delta >= (uint64_t(1) << (LEVELS * SLOT_BITS))) {
+            expires = current + (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+        }
+        auto index = (expires >> (level * SLOT_BITS)) & SLOT_MASK;
+        auto &slot = slots[level][index];
+        timer.prev = slot.prev;
+        timer.next = &slot;
+        slot.prev->next = &timer;
+        slot.prev = &timer;
+        occupied[level] |= uint64_t(1) << index;
+    }
+
+    void unlink(Timer &timer) {
+        auto *next = timer.next;
+        timer.prev->next = next;
+        next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+        if (next == next->next) {
+            /// next is the slot sentinel which became empty
+            clear_occupied(next);
+        }
+    }
+
+    void clear_occupied(Timer *sentinel) {
+        auto offset = sentinel - &slots[0][0];
+        occupied[offset / SLOTS] &= ~(uint64_t(1) << (offset % SLOTS));
+    }
+
+    /// Move timers of the next slot of upper levels down, called on level 0 wrap
+    void cascade() {
+        for (int level = 1; level != LEVELS; ++level) {
+            auto index = (current >> (level * SLOT_BITS)) & SLOT_MASK;
+            auto &slot = slots[level][index];
+            auto *timer = slot.next;
+            slot.prev = slot.next = &slot;
+            occupied[level] &= ~(uint64_t(1) << index);
+            while (timer != &slot) {
+                auto *next = timer->next;
+                insert(*timer);
+                timer = next;
+            }
+            if (index != 0) {
+                break;
+            }
+        }
+    }
+
+    Clock::time_point start;
+    /// Next tick to process
+    uint64_t current = 0;
+    size_t count = 0;
+    uint64_t occupied[LEVELS] = {};
+    Timer slots[LEVELS][SLOTS];
+};
@@ -0,0 +1,170 @@
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "fibers.hpp"
+
+namespace {
+
+    /// Rings outlive their threads so late events can still be drained
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<Tracing::Ring>> rings;
+
+    thread_local std::shared_ptr<Tracing::Ring> owned_ring;
+
+    constexpr char MAGIC[4] = {'F', 'B', 'T', 'R'};
+    constexpr uint32_t VERSION = 1;
+
+}
+
+namespace Tracing {
+
+    thread_local Ring *current_ring = nullptr;
+
+    Ring &register_ring() {
+        std::lock_guard lock(rings_mutex);
+        owned_ring = std::make_shared<Ring>(static_cast<uint32_t>(rings.size()));
+        rings.push_back(owned_ring);
+        current_ring = owned_ring.get();
+        return *current_ring;
+    }
+
+    std::vector<Event> drain() {
+        std::vector<Event> events;
+        {
+            std::lock_guard lock(rings_mutex);
+            for (auto &ring : rings) {
+                ring->consume(events);
+            }
+        }
+        std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+            return a.tsc < b.tsc;
+        });
+        return events;
+    }
+
+    uint64_t dropped() {
+        std::lock_guard lock(rings_mutex);
+        uint64_t total = 0;
+        for (auto &ring : rings) {
+            total += ring->lost();
+        }
+        return total;
+    }
+
+    void write_chrome(const std::vector<Event> &events, std::ostream &out, double ns_per_cycle) {
+        if (ns_per_cycle <= 0) {
+            ns_per_cycle = Profiler::ns_per_cycle();
+        }
+        auto base = events.empty() ? 0 : events.front().tsc;
+        auto us = [&](uint64_t tsc) {
+            return (tsc - base) * ns_per_cycle / 1000;
+        };
+
+        /// Open span of each fiber: name and start
+        struct Span {
+            const char *name = nullptr;
+            uint64_t since = 0;
+            uint32_t thread = 0;
+        };
+        std::unordered_map<uint64_t, Span> spans;
+        bool first = true;
+        auto emit = [&](uint64_t fiber, const Span &span, uint64_t until) {
+            out << (first ? "\n" : ",\n")
+                << R"({"name":")" << span.name << R"(","ph":"X","pid":1,"tid":)" << fiber
+                << R"(,"ts":)" << us(span.since) << R"(,"dur":)" << us(until) - us(span.since)
+                << R"(,"args":{"thread":)" << span.thread << "}}";
+            first = false;
+        };
+        auto open = [&](const Event &event, const char *name) {
+            auto &span = spans[event.fiber];
+            if (span.name) {
+                emit(event.fiber, span, event.tsc);
+            }
+            span = {name, event.tsc, event.thread};
+        };
+
+        out << R"({"displayTimeUnit":"ns","traceEvents":[)";
+        for (auto &event : events) {
+            switch (event.type) {
+                case Type::SPAWN:
+                    open(event, "queued");
+                    break;
+                case Type::SWITCH_IN:
+                    open(event, "running");
+                    break;
+                case Type::SWITCH_OUT:
+                    if (event.arg == Action::STOP) {
+                        auto it = spans.find(event.fiber);
+                        if (it != spans.end()) {
+                            emit(event.fiber, it->second, event.tsc);
+                            spans.erase(it);
+                        }
+                    } else {
+                        open(event, event.arg == Action::SCHED ? "queued" : "parked");
+                    }
+                    break;
+                case Type::PARK:
+                    out << (first ? "\n" : ",\n")
+                        << R"({"name":"park","ph":"i","s":"t","pid":1,"tid":)" << event.fiber
+                        << R"(,"ts":)" << us(event.tsc) << R"(,"args":{"fd":)" << event.arg << "}}";
+                    first = false;
+                    break;
+                case Type::WAKE: {
+                    /// Yielded fibers are queued already
+                    auto it = spans.find(event.fiber);
+                    if (it == spans.end() || std::strcmp(it->second.name, "parked") == 0) {
+                        open(event, "queued");
+                    }
+                    break;
+                }
+            }
+        }
+        /// Fibers alive at drain time end at the last event
+        auto last = events.empty() ? 0 : events.back().tsc;
+        for (auto &[fiber, span] : spans) {
+            emit(fiber, span, last);
+        }
+        out << "\n]}\n";
+    }
+
+    void write_binary(const std::vector<Event> &events, std::ostream &out) {
+        auto ns_per_cycle = Profiler::ns_per_cycle();
+        uint64_t count = events.size();
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(reinterpret_cast<const char *>(&VERSION), sizeof(VERSION));
+        out.write(reinterpret_cast<const char *>(&ns_per_cycle), sizeof(ns_per_cycle));
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char *>(events.data()), count * sizeof(Event));
+    }
+
+    std::vector<Event> read_binary(std::istream &in, double *ns_per_cycle) {
+        char magic[sizeof(MAGIC)];
+        uint32_t version;
+        double rate;
+        uint64_t count;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char *>(&version), sizeof(version));
+        in.read(reinterpret_cast<char *>(&rate), sizeof(rate));
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
+        if (!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION) {
+            throw std::runtime_error("Not a fiber trace");
+        }
+        std::vector<Event> events(count);
+        in.read(reinterpret_cast<char *>(events.data()), count * sizeof(Event));
+        if (!in) {
+            throw std::runtime_error("Truncated fiber trace");
+        }
+        if (ns_per_cycle) {
+            *ns_per_cycle = rate;
+        }
+        return events;
+    }
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+#include "profiling.hpp"
+
+/// Fiber lifecycle tracing, compiled in with -DFIBERS_TRACING (cmake
+/// -DFIBERS_TRACING=ON). Without it FIBERS_TRACE expands to nothing.
+///
+/// Every scheduler thread appends to its own single producer ring, so an
+/// event is a TSC read and a few stores. A full ring drops new events and
+/// counts them. drain() collects all rings from any thread. Fibers are
+/// identified by context address, reused once a fiber has stopped.
+#ifdef FIBERS_TRACING
+#define FIBERS_TRACE(type, context, arg) Tracing::record(Tracing::Type::type, context, arg)
+#else
+#define FIBERS_TRACE(type, context, arg) do {} while (false)
+#endif
+
+namespace Tracing {
+
+    enum class Type : uint32_t {
+        /// Context created for a fiber
+        SPAWN,
+        SWITCH_IN,
+        /// arg is Action::action the fiber switched out with
+        SWITCH_OUT,
+        /// Handed to the io backend, arg is fd or -1 for timers
+        PARK,
+        /// Queued to run again
+        WAKE,
+    };
+
+    struct Event {
+        uint64_t tsc;
+        uint64_t fiber;
+        Type type;
+        int32_t arg;
+        /// Ring of the thread which recorded the event
+        uint32_t thread;
+    };
+
+    class Ring {
+    public:
+        enum {
+            CAPACITY = 1 << 16,
+            MASK = CAPACITY - 1,
+        };
+
+        explicit Ring(uint32_t thread) : thread(thread), events(new Event[CAPACITY]) {
+        }
+
+        void push(Type type, const void *fiber, int32_t arg) {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == CAPACITY) {
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return;
+            }
+            events[h & MASK] = {Profiler::now(), reinterpret_cast<uintptr_t>(fiber), type, arg, thread};
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        /// Move recorded events to out, consumers are serialized by drain()
+        void consume(std::vector<Event> &out) {
+            auto t = tail.load(std::memory_order_relaxed);
+            auto h = head.load(std::memory_order_acquire);
+            for (; t != h; ++t) {
+                out.push_back(events[t & MASK]);
+            }
+            tail.store(t, std::memory_order_release);
+        }
+
+        uint64_t lost() const {
+            return dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        const uint32_t thread;
+        std::unique_ptr<Event[]> events;
+        alignas(64) std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> dropped{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+    };
+
+    extern thread_local Ring *current_ring;
+
+    /// Create and register ring of current thread
+    Ring &register_ring();
+
+    inline void record(Type type, const void *fiber, int32_t arg = 0) {
+        auto *ring = current_ring;
+        if (!ring) {
+            ring = &register_ring();
+        }
+        ring->push(type, fiber, arg);
+    }
+
+    /// Events of all threads recorded so far, ordered by time
+    std::vector<Event> drain();
+
+    /// Events dropped on full rings
+    uint64_t dropped();
+
+    /// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev): one track
+    /// per fiber with queued, running and parked spans. TSC rate of this
+    /// machine unless ns_per_cycle is given.
+    void write_chrome(const std::vector<Event> &events, std::ostream &out, double ns_per_cycle = 0);
+
+    /// Compact dump: header with TSC rate, then raw events
+    void write_binary(const std::vector<Event> &events, std::ostream &out);
+
+    /// Events of write_binary, throws std::runtime_error on bad input
+    std::vector<Event> read_binary(std::istream &in, double *ns_per_cycle = nullptr);
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "scheduler.hpp"
+
+/// Chase-Lev work stealing deque (Le, Pop, Cohen, Nardelli 2013).
+/// Owner pushes and pops at bottom, other threads steal from top.
+template <class T>
+class ChaseLevDeque {
+    static_assert(std::is_pointer_v<T>);
+
+public:
+    explicit ChaseLevDeque(size_t capacity = 256) {
+        arrays.push_back(std::make_unique<Array>(capacity));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    ChaseLevDeque(const ChaseLevDeque &other) = delete;
+    void operator=(const ChaseLevDeque &other) = delete;
+
+    /// Owner only
+    void push(T item) {
+        auto b = bottom.load(std::memory_order_relaxed);
+        auto t = top.load(std::memory_order_acquire);
+        auto *a = array.load(std::memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(a->mask)) {
+            a = grow(a, t, b);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /// Owner only, nullptr if empty
+    T pop() {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        auto *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T item = a->get(b);
+        if (t == b) {
+            /// Last item, race with thieves
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /// Any thread, nullptr if empty or lost race
+    T steal() {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        auto *a = array.load(std::memory_order_acquire);
+        T item = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+private:
+    struct Array {
+        size_t mask;
+        std::unique_ptr<std::atomic<T>[]> items;
+
+        explicit Array(size_t capacity) : mask(capacity - 1), items(new std::atomic<T>[capacity]) {
+        }
+
+        T get(int64_t i) {
+            return items[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T item) {
+            items[i & mask].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    Array *grow(Array *old, int64_t t, int64_t b) {
+        auto bigger = std::make_unique<Array>((old->mask + 1) * 2);
+        for (auto i = t; i != b; ++i) {
+            bigger->put(i, old->get(i));
+        }
+        /// Old arrays are kept alive: a thief may still read from them
+        arrays.push_back(std::move(bigger));
+        array.store(arrays.back().get(), std::memory_order_release);
+        return arrays.back().get();
+    }
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Array *> array;
+    std::vector<std::unique_ptr<Array>> arrays;
+};
+
+/// Runs fibers on several threads. Each worker owns a deque of contexts and
+/// steals from others when idle. Contexts migrate between workers freely,
+/// so fibers must not keep thread local state across yield.
+class WorkStealingScheduler {
+public:
+    explicit WorkStealingScheduler(size_t workers = std::thread::hardware_concurrency());
+
+    ~WorkStealingScheduler();
+
+    WorkStealingScheduler(const WorkStealingScheduler &other) = delete;
+    void operator=(const WorkStealingScheduler &other) = delete;
+
+    /// Thread safe, may be called before or during run
+    template <class F>
+    void schedule(F &&fiber) {
+        inject(FiberScheduler::create_context_from_fiber(std::forward<F>(fiber)));
+    }
+
+    /// Run workers till all fibers are done, rethrows first fiber exception
+    void run();
+
+    size_t workers_count() const {
+        return workers.size();
+    }
+
+private:
+    class Worker : public FiberScheduler {
+    public:
+        Worker(WorkStealingScheduler &owner, size_t index);
+
+        using FiberScheduler::schedule;
+
+        void schedule(ContextPtr context) override;
+
+        void loop();
+
+    private:
+        friend class WorkStealingScheduler;
+
+        /// Own deque, then injected, then steal
+        Context *next();
+
+        /// Park the thread till work is scheduled or all fibers are done.
+        /// Returns work found while going to sleep.
+        Context *sleep();
+
+        WorkStealingScheduler &owner;
+        size_t index;
+        ChaseLevDeque<Context *> deque;
+        std::minstd_rand rng;
+    };
+
+    /// Push to injected deque from any thread
+    void inject(ContextPtr context);
+
+    void fail(std::exception_ptr error);
+
+    /// Wake sleeping workers, if any, after new work or the end of run
+    void wake(bool all);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex injected_mutex;
+    std::deque<Context *> injected;
+    /// Contexts queued or running
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> stopped{false};
+    /// Workers wait on the epoch, waking bumps it
+    std::atomic<uint32_t> wake_epoch{0};
+    std::atomic<size_t> sleeping{0};
+    std::exception_ptr exception;
+};